@@ -59,9 +59,11 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. libmm.so is built with a bigger one.
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -30,8 +31,16 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Latency percentiles reported by -p */
+#define NPCTS       4    /* p50, p99, p99.9 and max */
+static const double pcts[NPCTS] = {50.0, 99.0, 99.9, 100.0};
+
+/* Phase counts of the region replay (-R) */
+#define NPHASES     3
+static const int phases[NPHASES] = {1, 8, 64};
+
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((size_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
@@ -46,9 +55,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
+    enum {ALLOC, FREE, REALLOC, MEMALIGN} type; /* type of request */
     int index;                        /* index for free() to use later */
     int size;                         /* byte size of alloc/realloc request */
+    int align;                        /* alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -72,6 +82,16 @@ typedef struct {
     range_t *ranges;
 } speed_t;
 
+/* Parameters of one thread of the multithreaded replay (-T) */
+typedef struct {
+    trace_t *trace;  /* trace shared read-only by all the threads */
+    char **blocks;   /* this thread's own copy of the block pointers */
+    int part;        /* replays the blocks whose id is part modulo nparts, */
+    int nparts;      /* all of them when nparts is 1 */
+    int libc;        /* replay with the malloc of libc instead of mm */
+    int failed;      /* set if an allocation returned NULL */
+} replay_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,6 +101,17 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double malloc_lat[NPCTS]; /* mm_malloc latency percentiles in nsecs (-p) */
+    double free_lat[NPCTS];   /* mm_free latency percentiles in nsecs (-p) */
+    size_t peak;              /* largest heap size while replaying (-r) */
+    size_t rss_before;        /* resident heap bytes after the replay (-r) */
+    size_t rss_after;         /* resident heap bytes after mm_trim (-r) */
+    long reallocs;            /* number of realloc requests in the trace */
+    double copied;            /* bytes realloc copied when it moved a block */
+    size_t live;              /* largest total payload of the trace */
+    mm_stats_t heap;          /* mm_stats when the payload peaked (-v) */
+    long blocks;              /* allocated blocks then, by mm_heap_next */
+    long sbrks;               /* calls of mem_sbrk that grew the heap */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
@@ -90,6 +121,7 @@ typedef struct {
  *******************/
 int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
+static long profile = 0; /* sampling rate of the heap profile, 0 if off */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
 /* Directory where default tracefiles are found */
@@ -122,11 +154,24 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static double eval_mt(trace_t *trace, int nthreads, int split, int libc);
+static int eval_mm_region(trace_t *trace, int nphases, double *kops,
+			  size_t *peak);
+static void eval_mm_trim(trace_t *trace, stats_t *stats);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printlatency(int n, stats_t *stats);
+static void printtrim(int n, stats_t *stats);
+static void printcopies(int n, stats_t *stats);
+static void printheap(int n, stats_t *stats);
+static void printgrowth(int n, stats_t *stats);
+static void printmt(int n, stats_t *stats, double *kops, int threads,
+		    int split);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -150,6 +195,16 @@ int main(int argc, char **argv)
    // int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int latency = 0;     /* If set, measure per-op latency of mm (-p) */
+    int trim = 0;        /* If set, measure resident memory around mm_trim (-r) */
+    int mt_threads = 0;  /* If set, replay on 1..mt_threads threads (-T) */
+    double *mt_kops[2];  /* Kops of the -T replay of copies and of a split
+			    trace, per trace, allocator and thread count */
+    int split, libc;
+    int regions = 0;     /* If set, replay with a region per phase (-R) */
+    double *rg_kops = NULL; /* Kops of the -R replay per trace and phase count */
+    size_t *rg_peak = NULL; /* and its peak heap */
+    int j;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +213,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:T:P:hvVgalprR")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +239,30 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'T': /* Replay the traces on up to this many threads */
+            mt_threads = atoi(optarg);
+            if (mt_threads < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'p': /* Print per-trace latency percentiles */
+            latency = 1;
+            break;
+        case 'P': /* Sample the heap and print its profile at each peak */
+            profile = atol(optarg);
+            if (profile <= 0) {
+                usage();
+                exit(1);
+            }
+            mm_prof_rate(profile);
+            break;
+        case 'r': /* Print resident heap memory before and after mm_trim */
+            trim = 1;
+            break;
+        case 'R': /* Replay the traces with a region per phase */
+            regions = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -298,12 +377,16 @@ int main(int argc, char **argv)
 	if (mm_stats[i].valid) {
 	    if (verbose > 1)
 		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+	    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &mm_stats[i]);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
 	    if (verbose > 1)
 		printf("and performance.\n");
 	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (latency)
+		eval_mm_latency(trace, &mm_stats[i]);
+	    if (trim)
+		eval_mm_trim(trace, &mm_stats[i]);
 	}
 	free_trace(trace);
     }
@@ -313,6 +396,105 @@ int main(int argc, char **argv)
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
+	printf("Bytes copied by mm_realloc, amortized over the reallocs:\n");
+	printcopies(num_tracefiles, mm_stats);
+	printf("\n");
+	printf("Heap when the payload peaked, from mm_stats (KB):\n");
+	printheap(num_tracefiles, mm_stats);
+	printf("\n");
+	printf("Heap growth: calls of mem_sbrk, and the peak heap (KB):\n");
+	printgrowth(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay every trace on 1..mt_threads threads at once, with
+     * mm and with libc: independent copies of the trace, one per thread,
+     * and the trace split among the threads by block id. Runs after the
+     * single threaded evaluation, since it ties the replay threads to
+     * arenas of their own.
+     */
+    if (mt_threads) {
+	for (split = 0; split < 2; split++)
+	    if ((mt_kops[split] = (double *)calloc(num_tracefiles * 2 * mt_threads,
+						   sizeof(double))) == NULL)
+		unix_error("mt_kops calloc in main failed");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    for (split = 0; split < 2; split++)
+		for (libc = 0; libc < 2; libc++)
+		    for (j = 1; j <= mt_threads; j++)
+			mt_kops[split][(i*2 + libc)*mt_threads + j-1] =
+			    eval_mt(trace, j, split, libc);
+	    free_trace(trace);
+	}
+	printf("\nMultithreaded replay of independent trace copies (Kops):\n");
+	printmt(num_tracefiles, mm_stats, mt_kops[0], mt_threads, 0);
+	printf("\nMultithreaded replay of each trace split by block id (Kops):\n");
+	printmt(num_tracefiles, mm_stats, mt_kops[1], mt_threads, 1);
+	printf("\n");
+    }
+
+    /*
+     * Optionally replay every trace with a region per phase: the blocks
+     * allocated in a phase come from its region, which is reset once they
+     * are all freed. Column 0 is the replay with mm_malloc and mm_free.
+     */
+    if (regions) {
+	if ((rg_kops = (double *)calloc(num_tracefiles * (NPHASES+1),
+					sizeof(double))) == NULL ||
+	    (rg_peak = (size_t *)calloc(num_tracefiles * (NPHASES+1),
+					sizeof(size_t))) == NULL)
+	    unix_error("rg_kops calloc in main failed");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    for (j = 0; j <= NPHASES; j++)
+		if (!eval_mm_region(trace, j ? phases[j-1] : 0,
+				    &rg_kops[i*(NPHASES+1) + j],
+				    &rg_peak[i*(NPHASES+1) + j]))
+		    rg_kops[i*(NPHASES+1) + j] = -1;
+	    free_trace(trace);
+	}
+	printf("\nReplay with a region per phase (Kops, peak heap KB):\n");
+	printf("%5s%16s", "", "malloc/free");
+	for (j = 0; j < NPHASES; j++)
+	    printf("%9d %-6s", phases[j], phases[j] == 1 ? "phase" : "phases");
+	printf("\n%5s", "trace");
+	for (j = 0; j <= NPHASES; j++)
+	    printf("%8s%8s", "Kops", "heap");
+	printf("\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    if (!mm_stats[i].valid)
+		continue;
+	    printf("%2d   ", i);
+	    for (j = 0; j <= NPHASES; j++) {
+		if (rg_kops[i*(NPHASES+1) + j] < 0)
+		    printf("%8s%8s", "-", "-");
+		else
+		    printf("%8.0f%8zu", rg_kops[i*(NPHASES+1) + j],
+			   rg_peak[i*(NPHASES+1) + j] / 1024);
+	    }
+	    printf("\n");
+	}
+	printf("\n");
+    }
+
+    /* Display the resident memory around mm_trim */
+    if (trim) {
+	printf("\nResident heap memory before and after mm_trim(0) (KB):\n");
+	printtrim(num_tracefiles, mm_stats);
+	printf("\n");
+    }
+
+    /* Display the mm latency percentiles */
+    if (latency) {
+	printf("\nLatency percentiles for mm malloc (nsecs):\n");
+	printlatency(num_tracefiles, mm_stats);
+	printf("\n");
     }
 
     /* 
@@ -396,9 +578,9 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of
+       a region the package mapped */
+    if (!mem_contains(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -478,7 +660,7 @@ static trace_t *read_trace(char *tracedir, char *filename)
     trace_t *trace;
     char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -535,6 +717,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
 	case 'f':
 	    fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
@@ -630,6 +820,29 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    trace->block_sizes[index] = size;
 	    break;
 
+        case MEMALIGN: /* mm_memalign */
+
+	    /* Call the student's memalign */
+	    if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+		malloc_error(tracenum, i, "mm_memalign failed.");
+		return 0;
+	    }
+
+	    /* The block must have the requested alignment on top of
+	     * everything a block from mm_malloc must satisfy */
+	    if ((size_t)p % trace->ops[i].align != 0) {
+		malloc_error(tracenum, i, "Payload address is not aligned as requested");
+		return 0;
+	    }
+	    if (add_range(ranges, p, size, tracenum, i) == 0)
+		return 0;
+	    memset(p, index & 0xFF, size);
+
+	    /* Remember region */
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
@@ -690,21 +903,49 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   largest size of the heap in bytes while running the student's malloc 
+ *   package on the trace. The package may decrement the brk pointer,
+ *   so the high water mark of brk is kept by mem_peaksize().
+ *   It also counts the reallocs into stats, and the bytes they copied:
+ *   when realloc moves a block, the smaller of its old and new sizes.
+ *   At the last request where the payload peaks, it takes mm_stats
+ *   and counts the allocated blocks with mm_heap_next, and prints the
+ *   heap profile with -P. It also counts the calls of mem_sbrk that
+ *   grew the heap.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    int peak_op = -1;
     char *p;
     char *newp, *oldp;
+    mm_block_t blk;
+
+    /* find the last request where the payload peaks. the block sizes
+       are overwritten by the replay below */
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (trace->ops[i].type == FREE) {
+	    total_size -= trace->block_sizes[index];
+	    continue;
+	}
+	if (trace->ops[i].type == REALLOC)
+	    total_size -= trace->block_sizes[index];
+	total_size += trace->ops[i].size;
+	trace->block_sizes[index] = trace->ops[i].size;
+	if (total_size >= max_total_size) {
+	    max_total_size = total_size;
+	    peak_op = i;
+	}
+    }
+    stats->live = max_total_size;
+    max_total_size = total_size = 0;
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
@@ -715,10 +956,15 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if (trace->ops[i].type == MEMALIGN)
+		p = mm_memalign(trace->ops[i].align, size);
+	    else
+		p = mm_malloc(size);
+	    if (p == NULL)
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -743,6 +989,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
 
+	    /* Count the bytes a moved block had to take along */
+	    stats->reallocs++;
+	    if (newp != oldp)
+		stats->copied += (newsize < oldsize) ? newsize : oldsize;
+
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = newsize;
@@ -773,9 +1024,20 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	if (i == peak_op) {
+	    mm_stats(&stats->heap);
+	    for (blk.bp = NULL; mm_heap_next(&blk); )
+		stats->blocks += blk.alloc;
+	    if (profile) {
+		printf("Trace %d at its peak, ", tracenum);
+		mm_prof_dump(stdout);
+	    }
+	}
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    stats->sbrks = mem_sbrkcount();
+    return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
@@ -806,6 +1068,14 @@ static void eval_mm_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+		app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
 	case REALLOC: /* mm_realloc */
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -826,6 +1096,442 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * cmp_double - qsort comparator for arrays of doubles
+ */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * percentiles - Sort the n samples in lat and store the pcts[]
+ *     percentiles of them in out
+ */
+static void percentiles(double *lat, int n, double *out)
+{
+    int k, idx;
+
+    if (n == 0) {
+	for (k = 0; k < NPCTS; k++)
+	    out[k] = 0;
+	return;
+    }
+    qsort(lat, n, sizeof(double), cmp_double);
+    for (k = 0; k < NPCTS; k++) {
+	idx = (int)(pcts[k] / 100.0 * n + 0.5) - 1;
+	if (idx < 0) idx = 0;
+	if (idx >= n) idx = n - 1;
+	out[k] = lat[idx];
+    }
+}
+
+/*
+ * nsecs - Current time of the monotonic clock in nsecs
+ */
+static double nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * eval_mm_latency - Replay the trace once, timing every mm_malloc and
+ *    mm_free call on its own, and record the latency percentiles of
+ *    each kind of call. Reallocs are replayed but not timed.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index;
+    int nmalloc = 0, nfree = 0;
+    double start;
+    double *mlat, *flat;
+    char *p;
+
+    if ((mlat = (double *)malloc(trace->num_ops * sizeof(double))) == NULL ||
+	(flat = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    start = nsecs();
+	    p = mm_malloc(trace->ops[i].size);
+	    mlat[nmalloc++] = nsecs() - start;
+	    if (p == NULL)
+		app_error("mm_malloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* mm_memalign, timed along with mm_malloc */
+	    start = nsecs();
+	    p = mm_memalign(trace->ops[i].align, trace->ops[i].size);
+	    mlat[nmalloc++] = nsecs() - start;
+	    if (p == NULL)
+		app_error("mm_memalign error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in eval_mm_latency");
+	    trace->blocks[index] = p;
+	    break;
+
+        case FREE: /* mm_free */
+	    start = nsecs();
+	    mm_free(trace->blocks[index]);
+	    flat[nfree++] = nsecs() - start;
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	}
+    }
+
+    percentiles(mlat, nmalloc, stats->malloc_lat);
+    percentiles(flat, nfree, stats->free_lat);
+    free(mlat);
+    free(flat);
+}
+
+/*
+ * eval_mm_trim - Replay the trace once on a heap whose pages are all
+ *    given back to the OS first, then record how much of the heap is
+ *    resident before and after mm_trim(0), and check that calloc still
+ *    clears what the trim left.
+ */
+static void eval_mm_trim(trace_t *trace, stats_t *stats)
+{
+    int i, j, index, size;
+    char *p;
+
+    /* Reset the heap, drop the pages earlier runs touched, and
+       initialize the mm package */
+    mem_reset_brk();
+    mem_release(mem_heap_lo(), MAX_HEAP);
+    if (mm_init() < 0)
+	app_error("mm_init failed in eval_mm_trim");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+		app_error("mm_malloc error in eval_mm_trim");
+	    trace->blocks[index] = p;
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+	    if ((p = mm_memalign(trace->ops[i].align, trace->ops[i].size)) == NULL)
+		app_error("mm_memalign error in eval_mm_trim");
+	    trace->blocks[index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+		app_error("mm_realloc error in eval_mm_trim");
+	    trace->blocks[index] = p;
+	    break;
+
+        case FREE: /* mm_free */
+	    mm_free(trace->blocks[index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_trim");
+	}
+    }
+
+    stats->peak = mem_peaksize();
+    stats->rss_before = mem_resident();
+    mm_trim(0);
+    stats->rss_after = mem_resident();
+
+    /* The free blocks mm_trim gave back must still know which of their
+       bytes are zero: calloc every size of the trace once more */
+    for (i = 0;  i < trace->num_ops;  i++) {
+	if (trace->ops[i].type == FREE)
+	    continue;
+	size = trace->ops[i].size;
+	if ((p = mm_calloc(1, size)) == NULL)
+	    continue;
+	for (j = 0; j < size; j++)
+	    if (p[j] != 0)
+		app_error("mm_calloc after mm_trim returned a nonzero byte");
+	mm_free(p);
+    }
+}
+
+/*
+ * replay_thread - Body of one thread of eval_mt. Replays the requests of
+ *    its part of the blocks, all of them for a copy of the trace, with
+ *    its own block array, so that no two threads share a block.
+ */
+static void *replay_thread(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    trace_t *trace = r->trace;
+    int i, index, size;
+    char *p;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (r->nparts > 1 && index % r->nparts != r->part)
+	    continue;
+	size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_malloc */
+	    p = r->libc ? malloc(size) : mm_malloc(size);
+	    break;
+
+        case MEMALIGN: /* mm_memalign */
+	    if (r->libc) {
+		if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+		    p = NULL;
+	    }
+	    else
+		p = mm_memalign(trace->ops[i].align, size);
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    p = r->libc ? realloc(r->blocks[index], size)
+		: mm_realloc(r->blocks[index], size);
+	    break;
+
+        case FREE: /* mm_free */
+	    if (r->libc)
+		free(r->blocks[index]);
+	    else
+		mm_free(r->blocks[index]);
+	    continue;
+
+	default:
+	    app_error("Nonexistent request type in replay_thread");
+	}
+	if (p == NULL) {
+	    r->failed = 1;
+	    return NULL;
+	}
+	r->blocks[index] = p;
+    }
+    return NULL;
+}
+
+/*
+ * eval_mt - Replay the trace on nthreads threads at once, with mm on a
+ *    fresh heap or with libc: a copy of the whole trace on every thread,
+ *    or the trace split among them by block id if split is set. Return
+ *    the best total throughput in Kops of three runs, or -1 if the heap
+ *    ran out.
+ */
+static double eval_mt(trace_t *trace, int nthreads, int split, int libc)
+{
+    int i, run;
+    double start, secs, kops, best = 0;
+    pthread_t *tids;
+    replay_t *args;
+
+    if ((tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t))) == NULL ||
+	(args = (replay_t *)calloc(nthreads, sizeof(replay_t))) == NULL)
+	unix_error("malloc failed in eval_mt");
+    for (i = 0; i < nthreads; i++) {
+	args[i].trace = trace;
+	args[i].part = i;
+	args[i].nparts = split ? nthreads : 1;
+	args[i].libc = libc;
+	if ((args[i].blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mt");
+    }
+
+    for (run = 0; run < 3 && best >= 0; run++) {
+	if (!libc) {
+	    mem_reset_brk();
+	    if (mm_init() < 0)
+		app_error("mm_init failed in eval_mt");
+	}
+	start = nsecs();
+	for (i = 0; i < nthreads; i++)
+	    if (pthread_create(&tids[i], NULL, replay_thread, &args[i]) != 0)
+		unix_error("pthread_create failed in eval_mt");
+	for (i = 0; i < nthreads; i++) {
+	    pthread_join(tids[i], NULL);
+	    if (args[i].failed)
+		best = -1;
+	}
+	secs = (nsecs() - start) / 1e9;
+	kops = (split ? 1.0 : nthreads) * trace->num_ops / 1e3 / secs;
+	if (best >= 0 && kops > best)
+	    best = kops;
+    }
+
+    for (i = 0; i < nthreads; i++)
+	free(args[i].blocks);
+    free(args);
+    free(tids);
+    return best;
+}
+
+/*
+ * region_retire - Resets the region of a phase whose blocks are all
+ *    freed, and keeps it for a later phase
+ */
+static void region_retire(mm_region_t **regions, mm_region_t **spare,
+			  int *nspare, int phase)
+{
+    mm_region_reset(regions[phase]);
+    spare[(*nspare)++] = regions[phase];
+    regions[phase] = NULL;
+}
+
+/*
+ * eval_mm_region - Replay the trace on a fresh heap, split into nphases
+ *    phases of as many requests. A block comes from the region of the
+ *    phase that allocates it, and realloc copies it into the region of
+ *    the current phase. Freeing a block only counts it, and a region is
+ *    reset once its phase is over and its last block is freed. With 0
+ *    phases, the trace is replayed with mm_malloc and mm_free instead.
+ *    Sets the best throughput in Kops of three runs and the peak heap.
+ *    Returns 0 if the heap ran out.
+ */
+static int eval_mm_region(trace_t *trace, int nphases, double *kops,
+			  size_t *peak)
+{
+    int i, run, index, phase, cur, next, nspare, ok = 1;
+    double start, secs;
+    int *phase_of, *live;
+    size_t *sizes, align;
+    mm_region_t **regions, **spare;
+    replay_t plain;
+    char *p;
+
+    *kops = 0;
+    if (nphases == 0) {
+	plain.trace = trace;
+	plain.part = plain.libc = plain.failed = 0;
+	plain.nparts = 1;
+	if ((plain.blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	    unix_error("malloc failed in eval_mm_region");
+	for (run = 0; run < 3 && !plain.failed; run++) {
+	    mem_reset_brk();
+	    if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_region");
+	    start = nsecs();
+	    replay_thread(&plain);
+	    secs = (nsecs() - start) / 1e9;
+	    if (trace->num_ops / 1e3 / secs > *kops)
+		*kops = trace->num_ops / 1e3 / secs;
+	}
+	*peak = mem_peaksize();
+	free(plain.blocks);
+	return !plain.failed;
+    }
+
+    if ((phase_of = (int *)malloc(trace->num_ids * sizeof(int))) == NULL ||
+	(sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL ||
+	(live = (int *)malloc(nphases * sizeof(int))) == NULL ||
+	(regions = (mm_region_t **)malloc(nphases * sizeof(mm_region_t *))) == NULL ||
+	(spare = (mm_region_t **)malloc(nphases * sizeof(mm_region_t *))) == NULL)
+	unix_error("malloc failed in eval_mm_region");
+
+    for (run = 0; run < 3 && ok; run++) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_mm_region");
+	memset(live, 0, nphases * sizeof(int));
+	memset(regions, 0, nphases * sizeof(mm_region_t *));
+	nspare = 0;
+	cur = -1;
+	next = 0;
+	start = nsecs();
+	for (i = 0;  i < trace->num_ops && ok;  i++) {
+	    /* request i starts phase cur+1 */
+	    if (i == next) {
+		if (cur >= 0 && live[cur] == 0)
+		    region_retire(regions, spare, &nspare, cur);
+		cur++;
+		next = (long)(cur+1) * trace->num_ops / nphases;
+		if (nspare > 0)
+		    regions[cur] = spare[--nspare];
+		else if ((regions[cur] = mm_region_create()) == NULL) {
+		    ok = 0;
+		    break;
+		}
+	    }
+	    index = trace->ops[i].index;
+	    switch (trace->ops[i].type) {
+
+	    case ALLOC: /* mm_region_alloc */
+	    case MEMALIGN:
+		align = trace->ops[i].type == MEMALIGN ? trace->ops[i].align : 1;
+		if ((p = mm_region_alloc(regions[cur],
+					 trace->ops[i].size + align-1)) == NULL) {
+		    ok = 0;
+		    break;
+		}
+		trace->blocks[index] = (char *)(((size_t)p + align-1) & ~(align-1));
+		phase_of[index] = cur;
+		sizes[index] = trace->ops[i].size;
+		live[cur]++;
+		break;
+
+	    case REALLOC: /* mm_region_alloc and a copy */
+		if ((p = mm_region_alloc(regions[cur], trace->ops[i].size)) == NULL) {
+		    ok = 0;
+		    break;
+		}
+		memcpy(p, trace->blocks[index], sizes[index] < trace->ops[i].size
+		       ? sizes[index] : trace->ops[i].size);
+		live[cur]++;
+		if (--live[phase_of[index]] == 0 && phase_of[index] != cur)
+		    region_retire(regions, spare, &nspare, phase_of[index]);
+		trace->blocks[index] = p;
+		phase_of[index] = cur;
+		sizes[index] = trace->ops[i].size;
+		break;
+
+	    case FREE: /* counted against the region */
+		if (--live[phase_of[index]] == 0 && phase_of[index] != cur)
+		    region_retire(regions, spare, &nspare, phase_of[index]);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_region");
+	    }
+	}
+	secs = (nsecs() - start) / 1e9;
+	if (ok && trace->num_ops / 1e3 / secs > *kops)
+	    *kops = trace->num_ops / 1e3 / secs;
+	*peak = mem_peaksize();
+	for (phase = 0; phase < nphases; phase++)
+	    if (regions[phase] != NULL)
+		mm_region_destroy(regions[phase]);
+	while (nspare > 0)
+	    mm_region_destroy(spare[--nspare]);
+    }
+
+    free(phase_of);
+    free(sizes);
+    free(live);
+    free(regions);
+    free(spare);
+    return ok;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -848,6 +1554,15 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    trace->blocks[trace->ops[i].index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0) {
+		malloc_error(tracenum, i, "libc posix_memalign failed");
+		unix_error("System message");
+	    }
+	    trace->blocks[trace->ops[i].index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[trace->ops[i].index];
@@ -892,6 +1607,14 @@ static void eval_libc_speed(void *ptr)
 	    trace->blocks[index] = p;
 	    break;
 
+        case MEMALIGN: /* posix_memalign */
+	    index = trace->ops[i].index;
+	    if (posix_memalign((void **)&p, trace->ops[i].align,
+			       trace->ops[i].size) != 0)
+		unix_error("posix_memalign failed in eval_libc_speed");
+	    trace->blocks[index] = p;
+	    break;
+
 	case REALLOC: /* realloc */
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
@@ -973,6 +1696,168 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printlatency - prints the latency percentiles of mm_malloc and mm_free
+ */
+static void printlatency(int n, stats_t *stats)
+{
+    int i, k;
+
+    printf("%5s%9s%9s%9s%9s%9s%9s%9s%9s\n", "trace",
+	   "m.p50", "m.p99", "m.p99.9", "m.max",
+	   "f.p50", "f.p99", "f.p99.9", "f.max");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d   ", i);
+	for (k = 0; k < NPCTS; k++)
+	    printf("%9.0f", stats[i].malloc_lat[k]);
+	for (k = 0; k < NPCTS; k++)
+	    printf("%9.0f", stats[i].free_lat[k]);
+	printf("\n");
+    }
+}
+
+/*
+ * printtrim - Print the peak heap size and the resident heap memory
+ *     before and after mm_trim for each trace
+ */
+static void printtrim(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%9s%9s%9s\n", "trace", "peak", "before", "after");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d   %9zu%9zu%9zu\n", i, stats[i].peak/1024,
+	       stats[i].rss_before/1024, stats[i].rss_after/1024);
+    }
+}
+
+/*
+ * printcopies - Print the bytes mm_realloc copied, amortized over the
+ *     reallocs, next to the utilization of each trace with reallocs
+ */
+static void printcopies(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%9s%11s%8s%6s\n", "trace", "reallocs", "copied", "/op", "util");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid || stats[i].reallocs == 0)
+	    continue;
+	printf("%2d   %9ld%11.0f%8.1f%5.0f%%\n", i, stats[i].reallocs,
+	       stats[i].copied, stats[i].copied / stats[i].reallocs,
+	       stats[i].util*100.0);
+    }
+}
+
+/*
+ * printheap - Print the mm_stats of each trace taken when its payload
+ *     peaked: the payload, the heap and its free blocks, the allocated
+ *     blocks, and the splits, coalesces and heap extensions so far
+ */
+static void printheap(int n, stats_t *stats)
+{
+    int i;
+    mm_stats_t *h;
+
+    printf("%5s%8s%8s%8s%8s%8s%8s%8s%9s%9s%8s\n", "trace", "live", "heap",
+	   "mapped", "free", "largest", "nfree", "nalloc", "splits",
+	   "coalesce", "extends");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	h = &stats[i].heap;
+	printf("%2d   %8zu%8zu%8zu%8zu%8zu%8zu%8ld%9lu%9lu%8lu\n", i,
+	       stats[i].live/1024, h->heap_bytes/1024, h->mapped_bytes/1024,
+	       h->free_bytes/1024, h->largest_free/1024, h->free_blocks,
+	       stats[i].blocks, h->splits, h->coalesces, h->extends);
+    }
+}
+
+/*
+ * printgrowth - Print how often each trace grew the heap, next to the
+ *     peak heap size and the utilization
+ */
+static void printgrowth(int n, stats_t *stats)
+{
+    int i;
+    long total = 0;
+
+    printf("%5s%8s%9s%6s\n", "trace", "sbrks", "peak", "util");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	printf("%2d   %8ld%9.0f%5.0f%%\n", i, stats[i].sbrks,
+	       stats[i].live / stats[i].util / 1024, stats[i].util*100.0);
+	total += stats[i].sbrks;
+    }
+    printf("Total%8ld\n", total);
+}
+
+/*
+ * printmt - Print the Kops of the -T replay of each trace on 1..threads
+ *     threads, with mm and with libc, then the total over the traces both
+ *     replayed, and the scaling efficiency: the total on n threads over n
+ *     times the total on one
+ */
+static void printmt(int n, stats_t *stats, double *kops, int threads,
+		    int split)
+{
+    static const char *names[2] = {"mm", "libc"};
+    int i, j, libc;
+    double ops, secs, total[2][threads];
+    double *k;
+
+    printf("%10s", "trace");
+    for (j = 1; j <= threads; j++)
+	printf("%7dT", j);
+    printf("\n");
+    for (i=0; i < n; i++) {
+	if (!stats[i].valid)
+	    continue;
+	for (libc = 0; libc < 2; libc++) {
+	    if (libc)
+		printf("%6s%-4s", "", names[libc]);
+	    else
+		printf("%2d    %-4s", i, names[libc]);
+	    for (j = 0; j < threads; j++) {
+		if (kops[(i*2 + libc)*threads + j] < 0)
+		    printf("%8s", "-");
+		else
+		    printf("%8.0f", kops[(i*2 + libc)*threads + j]);
+	    }
+	    printf("\n");
+	}
+    }
+    for (libc = 0; libc < 2; libc++) {
+	printf("%-6s%-4s", libc ? "" : "Total", names[libc]);
+	for (j = 0; j < threads; j++) {
+	    ops = secs = 0;
+	    for (i=0; i < n; i++) {
+		k = &kops[i*2*threads + j];
+		if (!stats[i].valid || k[0] < 0 || k[threads] < 0)
+		    continue;
+		ops += (split ? 1 : j+1) * stats[i].ops;
+		secs += (split ? 1 : j+1) * stats[i].ops / k[libc*threads];
+	    }
+	    total[libc][j] = secs > 0 ? ops / secs : 0;
+	    printf("%8.0f", total[libc][j]);
+	}
+	printf("\n");
+    }
+    printf("Efficiency, Total on n threads over n times 1T:\n");
+    for (libc = 0; libc < 2; libc++) {
+	printf("%6s%-4s", "", names[libc]);
+	for (j = 0; j < threads; j++)
+	    printf("%7.0f%%", total[libc][0] > 0
+		   ? 100.0 * total[libc][j] / ((j+1) * total[libc][0]) : 0);
+	printf("\n");
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1005,14 +1890,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValprR] [-f <file>] [-t <dir>] [-T <n>] [-P <n>]\n");
     fprintf(stderr, "Options\n");
 //    fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-p         Print mm_malloc/mm_free latency percentiles.\n");
+    fprintf(stderr, "\t-P <n>     Sample one in <n> bytes and print the heap profile at each peak.\n");
+    fprintf(stderr, "\t-r         Print resident heap memory before and after mm_trim.\n");
+    fprintf(stderr, "\t-R         Replay each trace with a region per phase.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay copies of each trace, and each trace split, on 1..n threads.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
@@ -2,7 +2,13 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *            Besides the brk heap, it hands out regions of their own,
+ *            modelling mmap, and keeps track of them for the driver.
+ *            It never calls malloc, since in libmm.so malloc is mm.c.
+ *            The heap starts on a huge page boundary, and may be backed
+ *            by huge pages.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -18,20 +24,51 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static size_t mem_peak;      /* largest footprint since the last reset */
+static char *mem_fresh;      /* heap bytes from here on read as zero */
+static long mem_sbrks;       /* calls that grew the heap since the last reset */
+static size_t mem_reserved;  /* bytes mapped for the heap, from mem_start_brk */
+static int mem_kind;         /* kind of pages of the heap, MEM_SMALL_PAGES etc. */
+static size_t mem_heap_page; /* their size, the unit the heap is given back in */
+
+/* regions handed out by mem_map */
+typedef struct {
+    char *lo;                /* first byte of the region */
+    size_t size;             /* size in bytes, a multiple of the page size */
+} region_t;
+static region_t *mem_regions;
+static int mem_nregions, mem_maxregions;
+static size_t mem_mapped;    /* total size of the regions */
+
+static void update_peak(void);
+static region_t *find_region(void *lo);
+static char *reserve(int hugetlb, size_t *size);
+
+/* rounds an address down/up to a page boundary */
+#define PAGE_DOWN(p) ((char *)((size_t)(p) & ~(mem_pagesize()-1)))
+#define PAGE_UP(p) PAGE_DOWN((char *)(p) + mem_pagesize()-1)
+/* the same for a page of the heap, which may be a huge one */
+#define HEAP_DOWN(p) ((char *)((size_t)(p) & ~(mem_heap_page-1)))
+#define HEAP_UP(p) HEAP_DOWN((char *)(p) + mem_heap_page-1)
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM.
+       pages only take memory once they are touched. */
+    if ((mem_start_brk = reserve(0, &mem_reserved)) == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_kind = MEM_SMALL_PAGES;
+    mem_heap_page = mem_pagesize();
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_fresh = mem_start_brk;                /* and was never touched */
+    mem_peak = 0;
 }
 
 /* 
@@ -39,35 +76,202 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_reset_brk();
+    munmap(mem_start_brk, mem_reserved);
+    if (mem_regions != NULL)
+	munmap(mem_regions, mem_maxregions * sizeof(region_t));
+    mem_regions = NULL;
+    mem_maxregions = 0;
+}
+
+/*
+ * mem_hugepages - back the heap with pages of the given kind from now on.
+ *    MEM_HUGETLB falls back to MEM_THP when the hugetlb pool has too few
+ *    pages. The heap must be empty, and its pages are given back to the
+ *    OS, so mm_init must follow. Returns the kind of pages it got.
+ */
+int mem_hugepages(int kind)
+{
+    char *p = NULL;
+    size_t size;
+
+    assert(mem_brk == mem_start_brk);
+    if (kind == MEM_HUGETLB && (p = reserve(1, &size)) == MAP_FAILED)
+	kind = MEM_THP;
+    if (kind != MEM_HUGETLB && mem_kind == MEM_HUGETLB && (p = reserve(0, &size)) == MAP_FAILED)
+	return mem_kind;
+    /* a hugetlb heap has a mapping of its own, swapped in for the old one */
+    if (kind == MEM_HUGETLB || mem_kind == MEM_HUGETLB) {
+	munmap(mem_start_brk, mem_reserved);
+	mem_start_brk = mem_brk = p;
+	mem_max_addr = p + MAX_HEAP;
+	mem_reserved = size;
+    }
+    /* pages touched before keep their size until they are given back */
+    else
+	madvise(mem_start_brk, mem_reserved, MADV_DONTNEED);
+    if (kind != MEM_HUGETLB)
+	madvise(mem_start_brk, mem_reserved, kind == MEM_THP ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+    mem_fresh = mem_start_brk;
+    mem_kind = kind;
+    mem_heap_page = kind == MEM_SMALL_PAGES ? mem_pagesize() : MEM_HUGE_PAGE;
+    return kind;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    The pages of the old heap stay mapped, so the next heap does not
+ *    fault them in again. Regions from mem_map are unmapped.
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    while (mem_nregions > 0)
+	mem_unmap(mem_regions[0].lo);
+    mem_peak = 0;
+    mem_sbrks = 0;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap, and the whole pages above the
+ *    new brk are given back to the OS, so they read as zero again.
+ *    Huge pages are only given back whole.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( ((mem_brk + incr) < mem_start_brk) || ((mem_brk + incr) > mem_max_addr)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (incr > 0)
+	mem_sbrks++;
+    if (incr < 0 && HEAP_UP(old_brk) > HEAP_UP(mem_brk)) {
+	madvise(HEAP_UP(mem_brk), HEAP_UP(old_brk) - HEAP_UP(mem_brk), MADV_DONTNEED);
+	if (mem_fresh <= HEAP_UP(old_brk) && mem_fresh > HEAP_UP(mem_brk))
+	    mem_fresh = HEAP_UP(mem_brk);
+    }
+    if (mem_brk > mem_fresh)
+	mem_fresh = mem_brk;
+    update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - model of an anonymous mmap. Returns a new region of at
+ *    least size bytes, aligned to a page, or NULL if there is no memory.
+ */
+void *mem_map(size_t size)
+{
+    char *p;
+    size_t old = mem_maxregions * sizeof(region_t);
+
+    size = (size_t)PAGE_UP(size);
+    /* the table of regions is mapped as well, a page at first */
+    if (mem_nregions == mem_maxregions) {
+	mem_maxregions = old ? 2*mem_maxregions : mem_pagesize() / sizeof(region_t);
+	if (old == 0)
+	    p = mmap(NULL, mem_maxregions * sizeof(region_t), PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	else
+	    p = mremap(mem_regions, old, mem_maxregions * sizeof(region_t), MREMAP_MAYMOVE);
+	if (p == MAP_FAILED) {
+	    fprintf(stderr, "mem_map: mmap error\n");
+	    exit(1);
+	}
+	mem_regions = (region_t *)p;
+    }
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    mem_regions[mem_nregions].lo = p;
+    mem_regions[mem_nregions].size = size;
+    mem_nregions++;
+    mem_mapped += size;
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_remap - model of mremap. Resizes the region at addr to at least
+ *    size bytes, moving it if it cannot grow in place, without copying
+ *    any page. Returns its new address, or NULL if there is no memory.
+ */
+void *mem_remap(void *addr, size_t size)
+{
+    region_t *r = find_region(addr);
+    char *p;
+
+    size = (size_t)PAGE_UP(size);
+    if (r == NULL)
+	return NULL;
+    p = mremap(r->lo, r->size, size, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    mem_mapped += size - r->size;
+    r->lo = p;
+    r->size = size;
+    update_peak();
+    return p;
+}
+
+/*
+ * mem_unmap - model of munmap. Gives the region at addr back to the OS.
+ */
+void mem_unmap(void *addr)
+{
+    region_t *r = find_region(addr);
+
+    if (r == NULL)
+	return;
+    munmap(r->lo, r->size);
+    mem_mapped -= r->size;
+    *r = mem_regions[--mem_nregions];
+}
+
+/*
+ * mem_contains - returns whether [lo, hi] lies within the heap or
+ *    within one region from mem_map
+ */
+int mem_contains(void *lo, void *hi)
+{
+    int i;
+
+    if ((char *)lo >= mem_start_brk && (char *)hi < mem_brk)
+	return 1;
+    for (i = 0; i < mem_nregions; i++)
+	if ((char *)lo >= mem_regions[i].lo &&
+	    (char *)hi < mem_regions[i].lo + mem_regions[i].size)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_release - give the whole pages within [addr, addr+size) back to
+ *    the OS, and return their size. They stay mapped and read as zero
+ *    when touched again.
+ */
+size_t mem_release(void *addr, size_t size)
+{
+    char *lo = HEAP_UP(addr);
+    char *hi = HEAP_DOWN((char *)addr + size);
+
+    if (hi <= lo || madvise(lo, hi - lo, MADV_DONTNEED) < 0)
+	return 0;
+    if (lo <= mem_fresh && hi >= mem_fresh)
+	mem_fresh = lo;
+    return hi - lo;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -84,6 +288,16 @@ void *mem_heap_hi()
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mem_heap_fresh - return the lowest address from which the heap reads
+ *    as zero up to its largest legal address. mem_sbrk hands out the
+ *    bytes at or above it untouched.
+ */
+void *mem_heap_fresh()
+{
+    return (void *)mem_fresh;
+}
+
 /*
  * mem_heapsize() - returns the heap size in bytes
  */
@@ -92,6 +306,41 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peaksize() - returns the largest footprint since the last reset,
+ *    the heap and the regions from mem_map together
+ */
+size_t mem_peaksize() 
+{
+    return mem_peak;
+}
+
+/*
+ * mem_sbrkcount() - returns how many calls of mem_sbrk grew the heap
+ *    since the last reset
+ */
+long mem_sbrkcount()
+{
+    return mem_sbrks;
+}
+
+/*
+ * mem_resident() - returns how many bytes of the heap model are in memory.
+ *    Regions from mem_map count as a whole.
+ */
+size_t mem_resident()
+{
+    static unsigned char vec[MAX_HEAP/4096+1];
+    size_t pages = MAX_HEAP/mem_pagesize();
+    size_t i, n = 0;
+
+    if (pages > sizeof(vec) || mincore(mem_start_brk, MAX_HEAP, vec) < 0)
+	return 0;
+    for (i = 0; i < pages; i++)
+	n += vec[i] & 1;
+    return n * mem_pagesize() + mem_mapped;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -99,3 +348,66 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_heap_pagesize() - returns the size of the pages of the heap, which
+ *    is the system page size unless mem_hugepages asked for huge pages
+ */
+size_t mem_heap_pagesize()
+{
+    return mem_heap_page;
+}
+
+/*
+ * update_peak - remembers the footprint if it is the largest so far
+ */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/*
+ * reserve - maps the address space for a heap of MAX_HEAP bytes, starting
+ *    on a huge page boundary, and sets size to the bytes mapped. Pages
+ *    only take memory once they are touched, but for hugetlb pages, which
+ *    must all be in the pool. Returns MAP_FAILED if it cannot.
+ */
+static char *reserve(int hugetlb, size_t *size)
+{
+    char *p, *lo;
+    size_t len;
+
+    if (hugetlb) {
+	/* the kernel aligns hugetlb mappings itself */
+	*size = (MAX_HEAP + MEM_HUGE_PAGE-1) & ~(size_t)(MEM_HUGE_PAGE-1);
+	return mmap(NULL, *size, PROT_READ|PROT_WRITE,
+		    MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    }
+    /* map a huge page more than needed, and cut off both ends */
+    *size = (size_t)PAGE_UP(MAX_HEAP);
+    len = *size + MEM_HUGE_PAGE;
+    p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+	return p;
+    lo = (char *)(((size_t)p + MEM_HUGE_PAGE-1) & ~(size_t)(MEM_HUGE_PAGE-1));
+    if (lo > p)
+	munmap(p, lo - p);
+    munmap(lo + *size, p + len - (lo + *size));
+    return lo;
+}
+
+/*
+ * find_region - returns the region starting at lo, or NULL
+ */
+static region_t *find_region(void *lo)
+{
+    int i;
+
+    for (i = 0; i < mem_nregions; i++)
+	if (mem_regions[i].lo == (char *)lo)
+	    return &mem_regions[i];
+    return NULL;
+}
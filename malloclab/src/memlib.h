@@ -1,11 +1,28 @@
 #include <unistd.h>
 
+/* kinds of pages that back the heap, see mem_hugepages */
+#define MEM_SMALL_PAGES 0   /* pages of the system page size */
+#define MEM_THP 1           /* transparent huge pages, by madvise */
+#define MEM_HUGETLB 2       /* huge pages of the hugetlb pool, by MAP_HUGETLB */
+#define MEM_HUGE_PAGE (1<<21)
+
 void mem_init(void);               
 void mem_deinit(void);
+int mem_hugepages(int kind);
+size_t mem_heap_pagesize(void);
 void *mem_sbrk(int incr);
+size_t mem_release(void *addr, size_t size);
+void *mem_map(size_t size);
+void *mem_remap(void *addr, size_t size);
+void mem_unmap(void *addr);
+int mem_contains(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
+void *mem_heap_fresh(void);
 size_t mem_heapsize(void);
+size_t mem_peaksize(void);
+long mem_sbrkcount(void);
+size_t mem_resident(void);
 size_t mem_pagesize(void);
 
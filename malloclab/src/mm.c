@@ -15,8 +15,12 @@
 #include <unistd.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
+#include <math.h>
+#include <execinfo.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -36,7 +40,21 @@
 
 #define CHUNKSIZE (1<<12) 
 
+// the heap of an arena grows by a chunk that doubles with every growth,
+// from CHUNKSIZE up to CHUNK_MAX, and halves after QUIET_OPS allocations
+// in a row that did not need to grow it. a chunk is never more than
+// 1/2^GROW_SHIFT of the heap the arena has, so the unused end of the
+// heap stays a small part of it.
+#ifndef CHUNK_MAX
+#define CHUNK_MAX (1<<16)
+#endif
+#ifndef GROW_SHIFT
+#define GROW_SHIFT 7
+#endif
+#define QUIET_OPS 256
+
 #define MAX(x, y) ((x) > (y)? (x) : (y))
+#define MIN(x, y) ((x) < (y)? (x) : (y))
 
 #define PACK(size, alloc) ((size) | (alloc))
 
@@ -46,37 +64,290 @@
 #define GET_SIZE(p) (GET(p) & ~0x7) 
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
+// allocated blocks have no footer, so every header also tells
+// whether the previous block is allocated.
+// the bit of an allocated block may change under a lock while the thread
+// owning the block reads its size without one, so both are atomic.
+#define PREV_ALLOC 0x2
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+#define SET_PREV_ALLOC(p) __atomic_fetch_or((unsigned int *)(p), PREV_ALLOC, __ATOMIC_RELAXED)
+#define CLR_PREV_ALLOC(p) __atomic_fetch_and((unsigned int *)(p), ~PREV_ALLOC, __ATOMIC_RELAXED)
+#define GET_ATOMIC(p) __atomic_load_n((unsigned int *)(p), __ATOMIC_RELAXED)
+#define GET_SIZE_ATOMIC(p) (GET_ATOMIC(p) & ~0x7)
+
+// the third lowest bit of an allocated block tells that realloc has grown it.
+// when realloc has to move such a block again, the new block gets as much
+// headroom again as the request, so a block that keeps growing is copied
+// a logarithmic number of times. the blocks with headroom are listed in
+// their arena, which takes the headroom back before it grows the heap.
+#define GROWN 0x4
+#define HEADROOM_SLOTS 16
+
+// on a free block, the same bit tells that its payload is known to be zero
+// from the offset in its third word up to its footer, so calloc need not
+// clear those bytes. only blocks of at least 3*DSIZE have the third word.
+#define ZERO 0x4
+#define ZERO_OFF(bp) ((char *)(bp)+2*WSIZE)
+#define ZERO_LO(bp) ((GET(HDRP(bp)) & ZERO) ? (char *)(bp)+GET(ZERO_OFF(bp)) : NULL)
+
+// block size for a request: header plus payload, at least the
+// 16 bytes a free block needs for its header, links and footer.
+#define ASIZE(size) MAX(2*DSIZE, ALIGN((size) + WSIZE))
+
 #define HDRP(bp) ((char *)(bp) - WSIZE) 
+// only free blocks have a footer
 #define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE))) 
+// only valid when the previous block is free
 #define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
 // macros for block pointers
 #define NEXT_PTR(bp) ((char *)(bp))
 #define PREV_PTR(bp) ((char *)(bp)+WSIZE)
-#define NEXT_FREE(bp) ((char *) GET(NEXT_PTR(bp))) 
-#define PREV_FREE(bp) ((char *) GET(PREV_PTR(bp)))
-#define PUTPTR(p, ptr) (*(unsigned int *)(p) = (unsigned int)(ptr))
-#define NEXT_CLASS_PTR(bp, class) ((char*)bp+WSIZE*class)
-#define NEXT_CLASS(bp, class) ((char*) GET(NEXT_CLASS_PTR(bp, class)))
+#define NEXT_FREE(bp) TOPTR(GET(NEXT_PTR(bp)))
+#define PREV_FREE(bp) TOPTR(GET(PREV_PTR(bp)))
+#define PUTPTR(p, ptr) PUT(p, TOOFF(ptr))
+
+// links are stored as 32-bit offsets from the start of the heap, in
+// units of DSIZE, so a 4-byte field reaches 32GB of heap on 64-bit hosts.
+// offset 0 is the padding word of the heap, so it stands for null.
+#define TOOFF(ptr) ((ptr) ? (unsigned int)(((char *)(ptr)-heap_lo)/DSIZE) : 0u)
+#define TOPTR(off) ((off) ? heap_lo+(size_t)(off)*DSIZE : NULL)
+
+// two-level segregated fit index.
+// the first level splits sizes by powers of two, and the second level
+// splits each power-of-two range into SL_COUNT equal subranges.
+// sizes below SMALL_BLOCK are kept in linear classes, one per DSIZE.
+#define SL_LOG2 3
+#define SL_COUNT (1<<SL_LOG2)
+#define FL_SHIFT (SL_LOG2+3)
+#define SMALL_BLOCK (1<<FL_SHIFT)
+#define FL_COUNT (32-FL_SHIFT+1)
+
+// number of entries of the own class probed before falling back to
+// the first non-empty bigger class. keeps find_bestfit bounded.
+#define PROBE_LIMIT 8
+
+// placement policy of find_bestfit, chosen with -DFIT_POLICY=<n>.
+// the policies differ only in the classes; blocks of the tree are always
+// the smallest that fits, the lowest address first.
+#define FIRST_FIT 1     // the first block that fits, own class upwards
+#define NEXT_FIT 2      // first fit, resuming the own class where it left off
+#define BEST_FIT 3      // the smallest block that fits
+#define BOUNDED_FIT 4   // the best of PROBE_LIMIT blocks, then any bigger one
+#define ADDR_FIT 5      // best fit, the lowest address among equal sizes
+#ifndef FIT_POLICY
+#define FIT_POLICY BOUNDED_FIT
+#endif
+
+// the free block at the top of the last segment of an arena is kept out
+// of the index, so find_bestfit never splits it while another block fits,
+// and the top stays free to grow in place or to be trimmed.
+// building with -DWILDERNESS=0 lists it like any other free block.
+#ifndef WILDERNESS
+#define WILDERNESS 1
+#endif
+
+// macros for the index stored in the prologue (lp is free_listp)
+#define FL_BITMAP(lp) ((char *)(lp))
+#define SL_BITMAP(lp, fl) ((char *)(lp)+WSIZE*(1+(fl)))
+#define HEAD_PTR(lp, fl, sl) ((char *)(lp)+WSIZE*(1+FL_COUNT+(fl)*SL_COUNT+(sl)))
+#define HEAD(lp, fl, sl) TOPTR(GET(HEAD_PTR(lp, fl, sl)))
+#define INDEX_WORDS (1+FL_COUNT+FL_COUNT*SL_COUNT)
+
+// small requests are served from runs: RUN_SIZE aligned pages cut into
+// equal slots of one size class, with no header per slot.
+// a run lives in the payload of an ordinary allocated block.
+#define RUN_SIZE (1<<12)
+#define RUN_CLASSES 8
+#define RUN_MAX (RUN_CLASSES*DSIZE)
+#define RUN_BLOCK (RUN_SIZE+DSIZE)
+#define SLOT_SIZE(c) (((c)+1)*DSIZE)
+#define SMALL_CLASS(size) (((size)-1)/DSIZE)
+#define BITMAP_WORDS 16
+#define RUN_HDR ((4+BITMAP_WORDS)*WSIZE)
+#define SLOTS(c) ((RUN_SIZE-RUN_HDR)/SLOT_SIZE(c))
+
+// macros for the run header at the start of every run
+#define RUN_NEXT(r) ((char *)(r))
+#define RUN_PREV(r) ((char *)(r)+WSIZE)
+#define RUN_NFREE(r) ((char *)(r)+2*WSIZE)
+#define RUN_CLASS(r) ((char *)(r)+3*WSIZE)
+#define RUN_BITMAP(r, i) ((char *)(r)+WSIZE*(4+(i)))
+#define RUN_OF(p) ((char *)((size_t)(p) & ~(size_t)(RUN_SIZE-1)))
+
+// heads of the lists of runs with free slots, one per class,
+// stored in the prologue right after the index.
+#define RUN_HEAD_PTR(lp, c) ((char *)(lp)+WSIZE*(INDEX_WORDS+(c)))
+#define RUN_HEAD(lp, c) TOPTR(GET(RUN_HEAD_PTR(lp, c)))
+
+// free blocks of at least TREE_MIN bytes are not in the index but in a
+// treap ordered by size, then address. a node is the free block itself,
+// with its left and right children in place of the next/prev pointers.
+// the priority of a node is a hash of its address.
+#define TREE_MIN (1<<16)
+#define TREE_LEFT(bp) ((char *)(bp))
+#define TREE_RIGHT(bp) ((char *)(bp)+WSIZE)
+#define TREE_PRIO(bp) (TOOFF(bp)*2654435761u)
+// the root comes after the run heads, with a padding word so that
+// the prologue stays a multiple of DSIZE.
+#define TREE_ROOT_PTR(lp) ((char *)(lp)+WSIZE*(INDEX_WORDS+RUN_CLASSES))
+#define PROLOGUE_WORDS (INDEX_WORDS+RUN_CLASSES+2)
+
+// page descriptor table: for every RUN_SIZE page of the heap, the
+// class of the run on it plus one, or 0 when it is not a run.
+#define PAGE_COUNT (MAX_HEAP/RUN_SIZE+1)
+#define PAGE_IDX(p) (((size_t)(p)>>12)-((size_t)heap_lo>>12))
+
+// requests of at least MMAP_THRESHOLD bytes get a memlib region of their
+// own. the payload follows a 2*DSIZE header holding the size of the region,
+// so it is aligned to 16 bytes.
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1<<20)
+#endif
+#define MMAP_HDR (2*DSIZE)
+#define MMAP_SIZE(bp) (*(size_t *)((char *)(bp)-MMAP_HDR))
+// a pointer outside the brk heap can only be a mapped block
+#define IS_MAPPED(bp) ((size_t)((char *)(bp)-heap_lo) >= MAX_HEAP)
+
+// number of arenas, independent heaps with their own index and lock.
+#define NARENAS 8
+
+// per-thread cache of freed blocks. bins 0..7 hold slots of the run
+// classes, and bin size/DSIZE holds blocks of that size up to TCACHE_MAX.
+// the bins are quick lists: a cached block is not coalesced until it
+// leaves the cache, and only a block of the same size takes it again.
+// building with -DTCACHE_COUNT=0 turns them off.
+#define TCACHE_MAX 512
+#define TCACHE_BINS (TCACHE_MAX/DSIZE+1)
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 7
+#endif
+
+// allocations are sampled for the heap profile, one in every PROF_RATE
+// bytes on average. the bytes between two samples are drawn from an
+// exponential distribution, so every byte is as likely to be sampled,
+// and a block more likely the bigger it is. building with -DPROF_RATE=0
+// turns sampling off, and mm_prof_rate changes the rate at run time.
+// a sample costs a backtrace, about 2us, so the rate is set for the
+// traces, which allocate kilobytes every 40ns.
+#ifndef PROF_RATE
+#define PROF_RATE (1<<23)
+#endif
+#define PROF_SLOTS 2048  // sampled blocks the profile holds, a power of two
+#define PROF_DEPTH 8     // frames of a call path, the caller of mm first
+#define CALLER __builtin_return_address(0)
+#define PROF_HASH(bp) (((size_t)(bp) >> 3) * 2654435761u & (PROF_SLOTS-1))
+
+// a region hands out blocks by bumping a pointer through chunks from
+// mm_malloc. its first chunk holds the region itself, and every further
+// chunk is twice the one before, up to REGION_CHUNK_MAX. a request of
+// more than a quarter of the next chunk gets a chunk of its own.
+#define REGION_CHUNK 4096
+#define REGION_CHUNK_MAX (1<<18)
+
+// an object pool keeps its objects in slabs of POOL_SLAB bytes, aligned
+// to their size so that an object finds its slab by masking. every thread
+// caches up to POOL_CACHE_COUNT objects for each of POOL_CACHES pools,
+// picked by the id of the pool. building with -DPOOL_CACHE_COUNT=0 turns
+// the caches off.
+#define POOL_SLAB (1<<16)
+#define POOL_CACHES 4
+#ifndef POOL_CACHE_COUNT
+#define POOL_CACHE_COUNT 32
+#endif
+#define SLAB_OF(obj) ((slab_t *)((size_t)(obj) & ~(size_t)(POOL_SLAB-1)))
 
 
 /*********************************************************
 * <Implemetation>
 *
 *  Each free block is in a specific free list according to its class(size).
-*  void* free_listp has 14 pointers for each class in its prologue.
-*  When a new memory should be allocated, its best match is searched from 
-*  a free list of the smallest (fittable) class. 
-*  If the match is not found, loop next smallest class until all bigger 
-*  classes are searched. 
-*  Still not found, then extend the heap to make space.
+*  Classes form a two-level segregated fit (TLSF) index: the first level
+*  is the power of two of the size, and the second level divides that
+*  power-of-two range into 8 equal parts.
+*  void* free_listp holds the whole index in its prologue: a bitmap of
+*  non-empty first level classes, one bitmap of non-empty second level
+*  classes per first level class, and the head of every list.
+*  When a new memory should be allocated, the first few blocks of the
+*  class of its size are probed for the best match. If none fits,
+*  the bitmaps give the first non-empty bigger class with find-first-set,
+*  and any block there is big enough. Both steps take constant time.
+*  This bounded best fit is the default placement policy; first fit, next
+*  fit, full best fit and address-ordered best fit can be built instead
+*  with -DFIT_POLICY, and make policy-report compares them.
+*  Free blocks of 64KB or more are kept apart in a treap, a binary search
+*  tree by size whose nodes live in the free blocks, so the smallest one
+*  that fits is found in logarithmic time.
+*  The free block at the top of the heap, the wilderness, is not in the
+*  index. It is only split when no other block fits, so the top of the
+*  heap stays free as long as it can.
+*  Still not found, then extend the heap to make space. The free block at
+*  the top of the heap is merged with the new space, which only has to
+*  make up the rest. The heap grows by a chunk that doubles with every
+*  growth, up to 1/128 of the heap, and halves again after a quiet period.
+*  When memlib backs the heap with huge pages, it grows to their ends.
 *  If the free block is much bigger than the size needed, split the block
 *  and place the leftover in the front of the free list of its size.
 *  When a block is naturally freed, the freed block is also placed back in the front of the
 *  free list of its size. 
-*  Every time a free block is made, it should be coalesced.s
+*  Every time a free block is made, it should be coalesced.
+*  Only free blocks have a footer. An allocated block is a header and its
+*  payload, and the second lowest bit of every header tells whether the
+*  previous block is allocated, which is all coalescing needs to know.
+*  Requests of at most 64 bytes do not get a block of their own. They take
+*  a slot of a run, a 4KB page of equal slots of one size class that sits
+*  inside an allocated block. A bitmap in the run header marks the used
+*  slots, and the runs of a class with free slots are linked from the
+*  prologue. page_class tells, for the page of any address, whether it is
+*  a run and of which class, so mm_free never reads a header for a slot.
+*  There are several arenas, each with its own index and lock. A thread
+*  is tied to one arena on its first call, round robin. All arenas grow
+*  through the one memlib heap, so an arena that finds the heap grown by
+*  another one starts a new segment on a fresh page, fenced like the
+*  first one, and page_arena tells the owner arena of every page.
+*  Each thread also keeps a small cache of blocks of its own arena it
+*  has freed, up to 7 per size, which malloc and free use without
+*  taking any lock. The cached blocks stay allocated for the arena.
+*  A block freed by a thread of another arena is pushed on the remote
+*  queue of its arena, a lock-free stack linked through the payloads,
+*  and the next malloc of that arena that takes the lock frees the whole
+*  queue at once. So freeing a foreign block never waits for a lock.
+*  Requests of 1MB or more bypass the heap and get a region of their own
+*  from memlib, which realloc resizes with mremap and free unmaps.
+*  realloc grows a block in place into the free blocks around it when it
+*  can. A block it has grown before and must move anyway gets twice the
+*  requested size, and the arena lists it with the size it really needs,
+*  so the headroom can be taken back before the heap has to grow.
+*  A free block may also know that its payload is zero from some offset
+*  on, as it is when it comes fresh from memlib, and keeps that across
+*  splits and coalescing, so calloc clears only the bytes before it.
+*  mm_memalign carves an aligned payload out of a free block the same way
+*  runs are made, and frees the slack around it.
+*  The batch calls take the lock once for many blocks: malloc carves them
+*  in a row from one free block, and free sorts them so that neighbours
+*  are merged before a single coalesce.
+*  Allocations are sampled about once in every 8MB for a heap profile.
+*  A sampled block is recorded with its size and call path in a table,
+*  until it is freed, and realloc carries the sample to the new block.
+*  A count of sampled blocks per page lets free skip the table for the
+*  blocks of all other pages. mm_prof_dump sums the samples by size
+*  class and by call path.
+*  A region carves blocks in order out of chunks of mm_malloc, with no
+*  header or placement of their own, and frees them only all at once:
+*  reset gives back every chunk but the first, which holds the region.
+*  An object pool carves objects of one size out of slabs of mm_memalign,
+*  aligned to their size, and links the freed ones through themselves in
+*  their slab. A slab that empties goes back to mm, but for one spare.
+*  Every thread keeps a few objects of its pools in the thread cache, and
+*  takes or returns half of them at once under the lock of the pool.
+*  Every arena counts its free blocks by size as they enter and leave the
+*  index, and its splits, coalesces and heap extensions, so mm_stats only
+*  sums a few counters. mm_heap_next walks the blocks of every segment.
+*  mm_trim shrinks the heap by the free block at its top, and memlib
+*  gives those pages back to the OS along with the pages inside the
+*  free blocks of the trees.
 *  Normal free blocks have next/prev pointers pointing to the next/prev free block
 *  in their free list.
 *  The 'prev pointer' of the first free block in a specific free list points to 
@@ -86,98 +357,537 @@
 
 
 
-// segregated list of classes, where each class is implemented with explicit list 
-void* free_listp;
+// a block realloc has given headroom, and the size it needs without it.
+typedef struct {
+    char *bp;
+    size_t asize;
+} headroom_t;
+
+// counters of an arena for mm_stats, kept under its lock.
+// the free blocks are counted by the power of two of their size.
+typedef struct {
+    size_t nfree[MM_CLASSES];
+    size_t freebytes[MM_CLASSES];
+    unsigned long splits, coalesces, extends;
+} counters_t;
+
+// an independent heap. its first segment starts with the prologue
+// that holds the index, later segments only have a fence.
+typedef struct {
+    pthread_mutex_t lock;
+    char *listp;    // index of the arena, null until first used
+    char *end;      // end of the last segment of the arena
+    void *remote;   // blocks freed by threads of other arenas
+    int id;
+    int nroom;      // number of blocks with headroom
+    char *rover;    // where next fit resumes, a free block or null
+    char *top;      // free block that ends at 'end', out of the index, or null
+    size_t chunk;   // bytes the heap grows by at least
+    size_t heap;    // bytes of heap the arena has
+    unsigned int quiet; // allocations since the heap last grew
+    headroom_t room[HEADROOM_SLOTS];
+    counters_t count;
+} arena_t;
+
+// the objects of a pool that a thread caches, linked through themselves.
+typedef struct {
+    unsigned long id;       // of the pool, 0 when unused
+    void *head;
+    int count;
+} pcache_t;
+
+// per-thread cache of freed blocks, linked through their payloads.
+typedef struct {
+    void *head[TCACHE_BINS];
+    unsigned char count[TCACHE_BINS];
+    arena_t *home;          // arena of the thread
+    unsigned int epoch;     // mm_init the cache and home belong to
+    long sample;            // bytes to allocate until the next sample
+    unsigned long long seed; // of the random intervals between samples
+    pcache_t pool[POOL_CACHES];
+} tcache_t;
+
+// a sampled block that is still allocated, in the table of the profile.
+typedef struct {
+    void *bp;               // null for an empty slot
+    size_t size;            // size requested
+    void *stack[PROF_DEPTH];
+    int depth;
+} sample_t;
+
+// a call path of the heap profile, and the samples it allocated.
+typedef struct {
+    void *stack[PROF_DEPTH];
+    int depth;
+    long count;
+    double bytes;           // bytes the samples stand for
+} site_t;
+
+// a chunk of a region, with its blocks after the header.
+typedef struct chunk {
+    struct chunk *next;     // chunk allocated before this one
+} chunk_t;
+
+struct mm_region {
+    chunk_t *chunks;        // newest first, ending in the chunk of the region
+    char *cur, *end;        // the unused bytes of the current chunk
+    size_t next_size;       // bytes of the next chunk
+};
+
+// a slab of a pool, with its objects after the header. it is on the
+// partial list of the pool while it has room, and on the full list after.
+typedef struct slab {
+    struct slab *next, *prev;
+    void *free;             // objects freed back to the slab
+    char *unused;           // objects never handed out start here
+    int used;               // objects allocated, or cached by a thread
+    int full;               // is it on the full list?
+} slab_t;
+
+struct mm_pool {
+    pthread_mutex_t lock;
+    size_t size;            // bytes of an object, a multiple of its alignment
+    size_t first;           // offset of the first object of a slab
+    slab_t *partial, *full;
+    slab_t *spare;          // an empty slab kept back from mm
+    unsigned long id;       // never reused, so stale caches do not match
+    struct mm_pool *next;   // in the list of live pools
+};
+
+// segregated list of classes, where each class is implemented with explicit list.
+// it is the index of the arena the thread is working on (cur).
+static __thread void* free_listp;
+static __thread arena_t* cur;
+// first byte of the heap, the base of every stored link
+static char* heap_lo;
+// size of the pages of the heap, bigger than RUN_SIZE for huge pages
+static size_t heap_page;
+// page descriptor table of runs, and the owner arena of every page
+static unsigned char page_class[PAGE_COUNT];
+static unsigned char page_arena[PAGE_COUNT];
+
+static arena_t arenas[NARENAS];
+static unsigned int next_arena;
+// bumped by every mm_init, so threads know their cache is stale
+static unsigned int epoch;
+// serializes the calls into memlib
+static pthread_mutex_t sbrk_lock = PTHREAD_MUTEX_INITIALIZER;
+// bytes in the regions of mapped blocks, under sbrk_lock
+static size_t mapped_bytes;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static __thread tcache_t tcache;
+
+// the live pools, so that a cache is only flushed into a pool that still
+// exists. the lock comes before that of a pool, and that before an arena.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static mm_pool_t *pools;
+static unsigned long pool_ids;
+
+// the heap profile: the sampled blocks that are still allocated, hashed
+// by address, and how many of them are on each page or mapped.
+// the counts are read without a lock, so free takes it only when its page
+// has a sample.
+static size_t prof_rate = PROF_RATE;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static sample_t prof_table[PROF_SLOTS];
+static int prof_count;
+static unsigned long prof_dropped;     // samples the full table had no room for
+static unsigned short page_sampled[PAGE_COUNT];
+static unsigned int mapped_sampled;
+// serializes mm_prof_dump, which builds the call paths here
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+static site_t prof_sites[PROF_SLOTS];
+
+static void arena_free(void *ptr);
 
 
 /*********************************************************
 * helper functions
 *********************************************************/
 
-// returns whether ptr is a valid pointer of a block.
+// returns whether ptr is a valid pointer of a free block.
 // a valid pointer should be placed within the heap range,
 // aligned to DSIZE, and must have identical boundary tags.
 static int isptr(void* ptr){
     void* he = mem_heap_hi();
-    if((char*)ptr <=(char*)he && ptr>=free_listp && !((unsigned int)(ptr)&0x7) && GET(HDRP(ptr))==GET(FTRP(ptr)))
+    if((char*)ptr <=(char*)he && ptr>=free_listp && !((size_t)(ptr)&0x7) && (GET(HDRP(ptr))&~(PREV_ALLOC|ZERO))==GET(FTRP(ptr)))
         return 1;
     return 0;
 }
 
+// index of the most/least significant set bit.
+static inline int msb(unsigned int x){
+    return 31-__builtin_clz(x);
+}
+static inline int lsb(unsigned int x){
+    return __builtin_ctz(x);
+}
+
+// tells the first/second level class for the given size of the block.
+static inline void mapping(size_t size, int *fl, int *sl){
+    int bit;
+    if(size < SMALL_BLOCK){
+        *fl = 0;
+        *sl = size/(SMALL_BLOCK/SL_COUNT);
+        return;
+    }
+    bit = msb(size);
+    *sl = (size>>(bit-SL_LOG2)) ^ SL_COUNT;
+    *fl = bit-FL_SHIFT+1;
+}
+
+
+// tells whether the block a of asize bytes comes before the node b.
+static inline int tree_less(char *a, size_t asize, char *b){
+    size_t bsize = GET_SIZE(HDRP(b));
+    return asize < bsize || (asize == bsize && a < b);
+}
+
+// returns the word that links the block bp of 'size' bytes into the tree,
+// or the null link it would hang from when it is not in the tree.
+static char *tree_link(char *bp, size_t size){
+    char *linkp = TREE_ROOT_PTR(free_listp);
+    char *node;
+
+    while((node = TOPTR(GET(linkp))) != NULL && node != bp)
+        linkp = tree_less(bp, size, node) ? TREE_LEFT(node) : TREE_RIGHT(node);
+    return linkp;
+}
+
+// inserts a free block into the tree. it goes down to the first node of
+// lower priority, and splits the subtree there into its two children.
+static void tree_insert(char *bp, size_t size){
+    char *linkp = TREE_ROOT_PTR(free_listp);
+    char *node, *l, *r;
+
+    while((node = TOPTR(GET(linkp))) != NULL && TREE_PRIO(node) > TREE_PRIO(bp))
+        linkp = tree_less(bp, size, node) ? TREE_LEFT(node) : TREE_RIGHT(node);
+    l = TREE_LEFT(bp);
+    r = TREE_RIGHT(bp);
+    while(node != NULL){
+        if(tree_less(node, GET_SIZE(HDRP(node)), bp)){
+            PUTPTR(l, node);
+            l = TREE_RIGHT(node);
+            node = TOPTR(GET(l));
+        }
+        else{
+            PUTPTR(r, node);
+            r = TREE_LEFT(node);
+            node = TOPTR(GET(r));
+        }
+    }
+    PUTPTR(l, NULL);
+    PUTPTR(r, NULL);
+    PUTPTR(linkp, bp);
+}
+
+// removes a free block from the tree by merging its two subtrees
+// in its place, the child of higher priority on top.
+static void tree_remove(char *bp, size_t size){
+    char *linkp = tree_link(bp, size);
+    char *a = TOPTR(GET(TREE_LEFT(bp)));
+    char *b = TOPTR(GET(TREE_RIGHT(bp)));
+
+    while(a != NULL && b != NULL){
+        if(TREE_PRIO(a) > TREE_PRIO(b)){
+            PUTPTR(linkp, a);
+            linkp = TREE_RIGHT(a);
+            a = TOPTR(GET(linkp));
+        }
+        else{
+            PUTPTR(linkp, b);
+            linkp = TREE_LEFT(b);
+            b = TOPTR(GET(linkp));
+        }
+    }
+    PUTPTR(linkp, a != NULL ? a : b);
+}
+
+// returns the smallest block of the tree of at least asize bytes.
+static void *tree_bestfit(size_t asize){
+    char *node = TOPTR(GET(TREE_ROOT_PTR(free_listp)));
+    char *res = NULL;
+
+    while(node != NULL){
+        if(GET_SIZE(HDRP(node)) >= asize){
+            res = node;
+            node = TOPTR(GET(TREE_LEFT(node)));
+        }
+        else
+            node = TOPTR(GET(TREE_RIGHT(node)));
+    }
+    return res;
+}
+
+// checks the subtree of node, whose keys must lie between lo and hi,
+// and returns its number of nodes.
+static int tree_check(char *node, char *lo, char *hi, int arena){
+    char *l, *r;
+
+    if(node == NULL)
+        return 0;
+    if(GET_ALLOC(HDRP(node)) || GET_SIZE(HDRP(node)) < TREE_MIN){
+        printf("[%p]tree containing dirty or small block.\n", node);
+        exit(1);
+    }
+    if((lo && tree_less(node, GET_SIZE(HDRP(node)), lo)) || (hi && tree_less(hi, GET_SIZE(HDRP(hi)), node))){
+        printf("[%p]tree out of order.\n", node);
+        exit(1);
+    }
+    if(page_arena[PAGE_IDX(node)] != arena){
+        printf("[%p]block of arena %d in tree of arena %d.\n", node, page_arena[PAGE_IDX(node)], arena);
+        exit(1);
+    }
+    l = TOPTR(GET(TREE_LEFT(node)));
+    r = TOPTR(GET(TREE_RIGHT(node)));
+    if((l && TREE_PRIO(l) > TREE_PRIO(node)) || (r && TREE_PRIO(r) > TREE_PRIO(node))){
+        printf("[%p]tree out of heap order.\n", node);
+        exit(1);
+    }
+    return 1 + tree_check(l, lo, node, arena) + tree_check(r, node, hi, arena);
+}
 
-// checking validity of memory allocation
+// checking validity of memory allocation, in every arena.
 static void mm_check(void){
-    char *bp;
+    char *bp, *seg;
+    int fl, sl, bfl, bsl;
+    void *saved_listp = free_listp;
+    size_t nfree[NARENAS] = {0}, freebytes[NARENAS] = {0}, n, bytes;
 
-    for(bp = free_listp;GET_SIZE(HDRP(bp))>0; bp = NEXT_BLKP(bp)){
+    // walks every segment of the heap. a segment starts with a padding word
+    // and a prologue or fence block, and ends with an epilogue. the next one
+    // starts on the next page.
+    for(seg = heap_lo; seg <= (char *)mem_heap_hi(); seg = bp + (-(size_t)bp & (RUN_SIZE-1))){
+    for(bp = seg+DSIZE;GET_SIZE(HDRP(bp))>0; bp = NEXT_BLKP(bp)){
         // checks if any contiguous free block has escaped from coalescing
         if(!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))){
             printf("coasecse failed.\n");
             exit(1);
         }
-        // checks if all free blocks are in the free list.
+        // checks if the next header knows the allocation state of this block
+        if(!GET_PREV_ALLOC(HDRP(NEXT_BLKP(bp))) != !GET_ALLOC(HDRP(bp))){
+            printf("prev alloc bit out of date.\n");
+            exit(1);
+        }
+        // checks if all free blocks are in the free list of their arena.
         // if both pointers are illegal, than the block is not in the free list.
         if(!GET_ALLOC(HDRP(bp))){
+            free_listp = arenas[page_arena[PAGE_IDX(bp)]].listp;
+            nfree[page_arena[PAGE_IDX(bp)]]++;
+            freebytes[page_arena[PAGE_IDX(bp)]] += GET_SIZE(HDRP(bp));
+            // the known zero bytes must be zero, and must leave out the links.
+            if(GET(HDRP(bp)) & ZERO){
+                if(ZERO_LO(bp) < bp+3*WSIZE || ZERO_LO(bp) > FTRP(bp)){
+                    printf("[%p]zero tail out of the block.\n", bp);
+                    exit(1);
+                }
+                for(char *p = ZERO_LO(bp); p < FTRP(bp); p++){
+                    if(*p){
+                        printf("[%p]dirty byte in zero tail.\n", bp);
+                        exit(1);
+                    }
+                }
+            }
+            // the top block of an arena is in no list.
+            if(bp == arenas[page_arena[PAGE_IDX(bp)]].top)
+                ;
+            // a big free block must be found in the tree.
+            else if(GET_SIZE(HDRP(bp)) >= TREE_MIN){
+                if(GET(tree_link(bp, GET_SIZE(HDRP(bp)))) == 0){
+                    printf("free block is not in tree.\n");
+                    exit(1);
+                }
+            }
             // a free block must have at least one valid pointer(whether prev or next)
             // that connects it to the free list.
-            if(!isptr(NEXT_FREE(bp)) && !isptr(PREV_FREE(bp))){
+            else if(!isptr(NEXT_FREE(bp)) && PREV_FREE(bp)!=free_listp && !isptr(PREV_FREE(bp))){
                 printf("free block is not in free list.\n");
                 exit(1);
             }
         }
     }
-    // checks if any dirty block(allocated) is in the free list.
+    }
+    for(int i=0;i<NARENAS;i++){
+    if((free_listp = arenas[i].listp) == NULL)
+        continue;
+    // checks if any dirty block(allocated) is in the free list,
+    // and if every block sits in the class of its size and in its arena.
     // searches for each segregated class.
-    for(int i=0;i<14;i++){
-        bp = NEXT_CLASS(free_listp, i);
-        for(;isptr(bp); bp=NEXT_FREE(bp)){
-            if(GET_ALLOC(HDRP(bp))){
-                printf("[%u]free list containing dirty block in class %d.\n", (unsigned int)bp, i+1);
+    for(fl=0;fl<FL_COUNT;fl++){
+        for(sl=0;sl<SL_COUNT;sl++){
+            bp = HEAD(free_listp, fl, sl);
+            // the bitmaps must agree with the emptiness of the list.
+            if((bp!=NULL) != ((GET(SL_BITMAP(free_listp, fl))>>sl)&1)){
+                printf("bitmap out of date in class %d/%d.\n", fl, sl);
+                exit(1);
+            }
+            for(;isptr(bp); bp=NEXT_FREE(bp)){
+                if(GET_ALLOC(HDRP(bp))){
+                    printf("[%p]free list containing dirty block in class %d/%d.\n", bp, fl, sl);
+                    exit(1);
+                }
+                mapping(GET_SIZE(HDRP(bp)), &bfl, &bsl);
+                if(bfl!=fl || bsl!=sl){
+                    printf("[%p]block of class %d/%d in class %d/%d.\n", bp, bfl, bsl, fl, sl);
+                    exit(1);
+                }
+                if(page_arena[PAGE_IDX(bp)]!=i){
+                    printf("[%p]block of arena %d in arena %d.\n", bp, page_arena[PAGE_IDX(bp)], i);
+                    exit(1);
+                }
+            }
+        }
+        if((GET(SL_BITMAP(free_listp, fl))!=0) != ((GET(FL_BITMAP(free_listp))>>fl)&1)){
+            printf("bitmap out of date in class %d.\n", fl);
+            exit(1);
+        }
+    }
+    tree_check(TOPTR(GET(TREE_ROOT_PTR(free_listp))), NULL, NULL, i);
+    // checks if the counters of mm_stats agree with the heap.
+    for(n=bytes=0, fl=0;fl<MM_CLASSES;fl++){
+        n += arenas[i].count.nfree[fl];
+        bytes += arenas[i].count.freebytes[fl];
+    }
+    if(n != nfree[i] || bytes != freebytes[i]){
+        printf("free block counters of arena %d out of date.\n", i);
+        exit(1);
+    }
+    // checks if every block with headroom is a grown block of the arena.
+    for(fl=0;fl<arenas[i].nroom;fl++){
+        bp = arenas[i].room[fl].bp;
+        if(!GET_ALLOC(HDRP(bp)) || !(GET(HDRP(bp)) & GROWN) || page_arena[PAGE_IDX(bp)]!=i
+           || GET_SIZE(HDRP(bp)) < arenas[i].room[fl].asize){
+            printf("[%p]bad block in headroom list of arena %d.\n", bp, i);
+            exit(1);
+        }
+    }
+    // checks if the top block is the free block at the end of the arena,
+    // and if a free block there is known as the top.
+    bp = arenas[i].top;
+    if(bp != NULL && (GET_ALLOC(HDRP(bp)) || NEXT_BLKP(bp) != arenas[i].end)){
+        printf("[%p]top of arena %d is not the free block at its end.\n", bp, i);
+        exit(1);
+    }
+    if(WILDERNESS && bp == NULL && !GET_PREV_ALLOC(HDRP(arenas[i].end))){
+        printf("free block at the end of arena %d is not its top.\n", i);
+        exit(1);
+    }
+    // checks if the rover of next fit is a free block of the arena.
+    bp = arenas[i].rover;
+    if(bp != NULL && (GET_ALLOC(HDRP(bp)) || page_arena[PAGE_IDX(bp)] != i)){
+        printf("[%p]rover of arena %d is not a free block.\n", bp, i);
+        exit(1);
+    }
+    // checks if every run with free slots is known as a run of its class
+    // and really has free slots.
+    for(fl=0;fl<RUN_CLASSES;fl++){
+        for(bp = RUN_HEAD(free_listp, fl); bp!=NULL; bp = TOPTR(GET(RUN_NEXT(bp)))){
+            if(page_class[PAGE_IDX(bp)]!=fl+1 || GET(RUN_CLASS(bp))!=fl){
+                printf("[%p]run of class %d not in page table.\n", bp, fl);
+                exit(1);
+            }
+            if(GET(RUN_NFREE(bp))==0 || GET(RUN_NFREE(bp))>SLOTS(fl)){
+                printf("[%p]full run in run list of class %d.\n", bp, fl);
                 exit(1);
             }
         }
     }
+    }
+    free_listp = saved_listp;
 }
 
-// tells the segregated class for the given size of the block.
-int classof(size_t size){
-    int cnt=0;
-    int class;
-    unsigned int mask = 1<<(8*sizeof(unsigned int)-1);
-    while(!(size&mask)) {
-        cnt++;
-        size<<=1;
-    }
-    class = 8*sizeof(unsigned long)-cnt-4<14? 8*sizeof(unsigned long)-cnt-5: 13 ;
-    return class;
+// marks the bytes of the free block bp from 'zero' up to its footer as
+// known to be zero. the bytes must be zero but for the links and the
+// offset, which are left out. a null 'zero' leaves the block unmarked.
+static void set_zero(char *bp, char *zero){
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if(zero == NULL || size < 3*DSIZE || zero >= FTRP(bp))
+        return;
+    if(zero < bp + 3*WSIZE)
+        zero = bp + 3*WSIZE;
+    PUT(HDRP(bp), GET(HDRP(bp)) | ZERO);
+    PUT(ZERO_OFF(bp), zero - bp);
 }
 
 // key function for adding a new free block to the free list.
 // it adds a new free block to the front of the free list of the 
-// according segregated class.
+// according segregated class, and marks the class as non-empty.
 static void addfirst(void* bp, size_t size){ 
     void* next_ptr;
-    int class= classof(size);
+    int fl, sl;
 
+    cur->count.nfree[msb(size)]++;
+    cur->count.freebytes[msb(size)] += size;
+#if WILDERNESS
+    if((char *)bp + size == cur->end){
+        cur->top = bp;
+        return;
+    }
+#endif
+    if(size >= TREE_MIN){
+        tree_insert(bp, size);
+        return;
+    }
+    mapping(size, &fl, &sl);
     // might be null if the list is empty. 
     // otherwise will be set to the first element of the list
-    next_ptr = NEXT_CLASS(free_listp, class);
+    next_ptr = HEAD(free_listp, fl, sl);
     // insert the block to the front of the list and set prev/next pointers
-    PUTPTR(NEXT_CLASS_PTR(free_listp, class), (char *) bp);
+    PUTPTR(HEAD_PTR(free_listp, fl, sl), (char *) bp);
     PUTPTR(NEXT_PTR(bp), (char *) next_ptr);
     PUTPTR(PREV_PTR(bp), (char *) free_listp);
     if(next_ptr!=NULL) PUTPTR(PREV_PTR(next_ptr), (char*) bp);
+    PUT(FL_BITMAP(free_listp), GET(FL_BITMAP(free_listp)) | (1u<<fl));
+    PUT(SL_BITMAP(free_listp, fl), GET(SL_BITMAP(free_listp, fl)) | (1u<<sl));
+}
+
+// takes out a free block from the free list of its class.
+// when the list becomes empty, the class is unmarked in the bitmaps.
+static void takeout(void* bp, size_t size){
+    void* next_ptr;
+    void* prev_ptr;
+    int fl, sl;
+
+    cur->count.nfree[msb(size)]--;
+    cur->count.freebytes[msb(size)] -= size;
+    if(bp == cur->top){
+        cur->top = NULL;
+        return;
+    }
+    if(size >= TREE_MIN){
+        tree_remove(bp, size);
+        return;
+    }
+    next_ptr = NEXT_FREE(bp);
+    prev_ptr = PREV_FREE(bp);
+#if FIT_POLICY == NEXT_FIT
+    if(bp == cur->rover)
+        cur->rover = next_ptr;
+#endif
+    if(next_ptr!=NULL) PUTPTR(PREV_PTR(next_ptr), prev_ptr);
+    if(prev_ptr!=free_listp){
+        PUTPTR(NEXT_PTR(prev_ptr), next_ptr);
+        return;
+    }
+    // when block is the first element of its free list
+    mapping(size, &fl, &sl);
+    PUTPTR(HEAD_PTR(free_listp, fl, sl), next_ptr);
+    if(next_ptr==NULL){
+        PUT(SL_BITMAP(free_listp, fl), GET(SL_BITMAP(free_listp, fl)) & ~(1u<<sl));
+        if(GET(SL_BITMAP(free_listp, fl))==0)
+            PUT(FL_BITMAP(free_listp), GET(FL_BITMAP(free_listp)) & ~(1u<<fl));
+    }
 }
 
 // coalesces a free block in a constant time.
+// the merged block keeps the known zero bytes of its last part.
 static void *coalesce(void *bp){
-    size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp))); 
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp)); 
     size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp))); 
     size_t size = GET_SIZE(HDRP(bp));
-    size_t prev_size = GET_SIZE(HDRP(PREV_BLKP(bp)));
-    size_t next_size = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-    void* next_free= NEXT_BLKP(bp);
-    void* prev_free= PREV_BLKP(bp);
+    char *zero = next_alloc ? ZERO_LO(bp) : ZERO_LO(NEXT_BLKP(bp));
 
     // if neither of the neighboring blocks are free, just return.
     if (prev_alloc && next_alloc) {
@@ -186,76 +896,103 @@ static void *coalesce(void *bp){
 
     // if the next block is free
     else if (prev_alloc && !next_alloc) {
-        int class = classof(next_size);
         // takes out the next block from the original list.
-        if(isptr(PREV_FREE(next_free))) {
-            if(PREV_FREE(next_free)==free_listp) // when block is the first element of its free list
-                PUTPTR(NEXT_CLASS_PTR(free_listp, class), NEXT_FREE(next_free));
-            else PUTPTR(NEXT_PTR(PREV_FREE(next_free)), NEXT_FREE(next_free));
-        }
-        if(isptr(NEXT_FREE(next_free))) 
-            PUTPTR(PREV_PTR(NEXT_FREE(next_free)), PREV_FREE(next_free));
+        takeout(NEXT_BLKP(bp), GET_SIZE(HDRP(NEXT_BLKP(bp))));
         // concatenating two free blocks
         size += GET_SIZE(HDRP(NEXT_BLKP(bp))); 
-        PUT(HDRP(bp), PACK(size,0)); 
+        PUT(HDRP(bp), PACK(size,0) | PREV_ALLOC); 
         PUT(FTRP(bp), PACK(size,0));
+        cur->count.coalesces++;
     }
     // if the previous block is free
     else if (!prev_alloc && next_alloc) {
-        int class = classof(prev_size);
         // takes out the previous block from the original list.
-        if(isptr(PREV_FREE(prev_free))){
-            if(PREV_FREE(prev_free)==free_listp) // when block is the first element of its free list
-                PUTPTR(NEXT_CLASS_PTR(free_listp, class), NEXT_FREE(prev_free));
-            else
-                PUTPTR(NEXT_PTR(PREV_FREE(prev_free)), NEXT_FREE(prev_free));
-        }
-        if(isptr(NEXT_FREE(prev_free)))
-            PUTPTR(PREV_PTR(NEXT_FREE(prev_free)), PREV_FREE(prev_free));
+        takeout(PREV_BLKP(bp), GET_SIZE(HDRP(PREV_BLKP(bp))));
         // concatenating two free blocks
         size += GET_SIZE(HDRP(PREV_BLKP(bp))); 
         PUT(FTRP(bp), PACK(size, 0)); 
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0)); 
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)))); 
         bp = PREV_BLKP(bp);
+        cur->count.coalesces++;
         }
     // if the next/previous blocks are both free
     else {
-        int prev_class = classof(prev_size);
-        int next_class = classof(next_size);
         // takes out the neighboring next/prev free block from the original list.
-        if(isptr(PREV_FREE(next_free))) {
-            if(PREV_FREE(next_free)==free_listp)
-                PUTPTR(NEXT_CLASS_PTR(free_listp, next_class), NEXT_FREE(next_free));
-            else PUTPTR(NEXT_PTR(PREV_FREE(next_free)), NEXT_FREE(next_free));
-        }
-        if(isptr(NEXT_FREE(next_free))) 
-            PUTPTR(PREV_PTR(NEXT_FREE(next_free)), PREV_FREE(next_free));
-        if(isptr(PREV_FREE(prev_free))){
-            if(PREV_FREE(prev_free)==free_listp)
-                PUTPTR(NEXT_CLASS_PTR(free_listp, prev_class), NEXT_FREE(prev_free));
-            else
-                PUTPTR(NEXT_PTR(PREV_FREE(prev_free)), NEXT_FREE(prev_free));
-        }if(isptr(NEXT_FREE(prev_free))) 
-            PUTPTR(PREV_PTR(NEXT_FREE(prev_free)), PREV_FREE(prev_free));
+        takeout(NEXT_BLKP(bp), GET_SIZE(HDRP(NEXT_BLKP(bp))));
+        takeout(PREV_BLKP(bp), GET_SIZE(HDRP(PREV_BLKP(bp))));
         // concatenating the blocks
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) +GET_SIZE(FTRP(NEXT_BLKP(bp))); 
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0)); 
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+        size += GET_SIZE(HDRP(PREV_BLKP(bp))) +GET_SIZE(HDRP(NEXT_BLKP(bp))); 
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) | GET_PREV_ALLOC(HDRP(PREV_BLKP(bp)))); 
         bp = PREV_BLKP(bp);
+        PUT(FTRP(bp), PACK(size, 0));
+        cur->count.coalesces += 2;
         }
+    set_zero(bp, zero);
     return bp;
     }
 
+// gets 'size' more bytes of heap for the current arena, and returns
+// them as a block pointer whose header is the old epilogue.
+// if another arena has grown the heap since, the bytes start a new segment
+// on a fresh page behind a fence block, unless 'grow_only' forbids it.
+// if 'zero' is not null, it is set to where the bytes memlib hands out
+// untouched begin.
+static char *arena_sbrk(size_t size, int grow_only, char **zero){
+    char *bp, *brk;
+    size_t pad, page;
+
+    pthread_mutex_lock(&sbrk_lock);
+    brk = (char *)mem_heap_hi()+1;
+    if(zero != NULL)
+        *zero = mem_heap_fresh();
+    if(brk == cur->end){
+        if((long)(bp = mem_sbrk(size)) == -1)
+            goto fail;
+    }
+    else{
+        if(grow_only)
+            goto fail;
+        pad = -(size_t)brk & (RUN_SIZE-1);
+        if((long)(brk = mem_sbrk(pad+2*DSIZE+size)) == -1)
+            goto fail;
+        brk += pad;
+        PUT(brk, 0);
+        PUT(brk + (1*WSIZE), PACK(DSIZE, 1)); // fence header
+        PUT(brk + (2*WSIZE), PACK(DSIZE, 1)); // fence footer
+        PUT(brk + (3*WSIZE), PACK(0, 1) | PREV_ALLOC); // epilogue header
+        bp = brk + 2*DSIZE;
+    }
+    cur->heap += size;
+    cur->end = bp + size;
+    cur->count.extends++;
+    for(page = PAGE_IDX(brk); page <= PAGE_IDX(cur->end-1); page++)
+        page_arena[page] = cur->id;
+    pthread_mutex_unlock(&sbrk_lock);
+    return bp;
+
+fail:
+    pthread_mutex_unlock(&sbrk_lock);
+    return NULL;
+}
+
 // extends the size of the heap when there is no space in the free list.
 static void *extend_heap(size_t words){
-    char *bp; 
+    char *bp, *zero, *top = cur->top; 
     size_t size;
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE; 
-    if ((long)(bp = mem_sbrk(size)) == -1)
+    if ((bp = arena_sbrk(size, 0, &zero)) == NULL)
         return NULL;
-    PUT(HDRP(bp), PACK(size, 0)); 
+    // in a new segment, the old top block is no longer at the top
+    if (top != NULL && top + GET_SIZE(HDRP(top)) != bp) {
+        takeout(top, GET_SIZE(HDRP(top)));
+        addfirst(top, GET_SIZE(HDRP(top)));
+    }
+    // the old epilogue header becomes the header of the new block
+    PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp))); 
     PUT(FTRP(bp), PACK(size, 0)); 
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); 
+    // the new bytes are zero unless an earlier heap has used them
+    set_zero(bp, MAX(zero, (char *)bp));
 
     // extended part of the heap becomes a new free block,
     // so coalesce it and insert it to the according free list.
@@ -265,228 +1002,2023 @@ static void *extend_heap(size_t words){
     return bp;
     }
 
+// returns the free block at the top of the current arena if it has at
+// least asize bytes, or null. it serves a request no other block fits.
+static void *top_fit(size_t asize){
+    if(cur->top != NULL && GET_SIZE(HDRP(cur->top)) >= asize)
+        return cur->top;
+    return NULL;
+}
+
+// how many bytes the current arena grows its heap by when it needs
+// 'need' more: at least its chunk, which doubles, and at least 'min'.
+// on huge pages the heap grows to the end of one, which is in memory
+// as a whole once any byte of it is touched.
+static size_t grow_size(size_t need, size_t min){
+    size_t size = MIN(cur->chunk, ALIGN(cur->heap >> GROW_SHIFT));
+
+    cur->chunk = MIN(2*cur->chunk, CHUNK_MAX);
+    cur->quiet = 0;
+    size = MAX(need, MAX(size, min));
+    if(heap_page > RUN_SIZE)
+        size += -(size_t)(cur->end + size) & (heap_page-1);
+    return size;
+}
+
+// grows the heap of the current arena for a free block of at least
+// 'need' bytes, and returns it. a free block at the top of the arena
+// is merged with the new bytes, so they only need to make up the rest.
+static void *grow_heap(size_t need){
+    size_t top = 0, size;
+    char *bp;
+
+    // headroom given back may have made the top big enough
+    if((bp = top_fit(need)) != NULL)
+        return bp;
+    if(!GET_PREV_ALLOC(HDRP(cur->end)))
+        top = GET_SIZE(cur->end - DSIZE);
+    size = grow_size(need - MIN(top, need), CHUNKSIZE);
+    // if another arena has grown the heap since, the new bytes start a
+    // segment of their own and the top is not merged
+    if((bp = extend_heap(size/WSIZE)) != NULL && GET_SIZE(HDRP(bp)) < need)
+        bp = extend_heap(MAX(need, size)/WSIZE);
+    return bp;
+}
+
+// counts an allocation the free blocks could serve. after QUIET_OPS
+// of them in a row, the chunk of the arena is halved.
+static void heap_quiet(void){
+    if(++cur->quiet >= QUIET_OPS){
+        cur->quiet = 0;
+        cur->chunk = MAX(cur->chunk/2, CHUNKSIZE);
+    }
+}
+
+// gives the free block at the top of the heap back to memlib, but for
+// 'pad' bytes of it. only the arena whose segment is the last one can
+// shrink. returns the number of bytes given back.
+static size_t arena_trim(size_t pad){
+    char *bp;
+    size_t size, keep;
+
+    pthread_mutex_lock(&sbrk_lock);
+    if((char *)mem_heap_hi()+1 != cur->end || GET_PREV_ALLOC(HDRP(cur->end))){
+        pthread_mutex_unlock(&sbrk_lock);
+        return 0;
+    }
+    bp = cur->end - GET_SIZE(cur->end - DSIZE);
+    size = GET_SIZE(HDRP(bp));
+    // the rest of the block must still be a valid free block
+    keep = pad ? MAX(ALIGN(pad), 2*DSIZE) : 0;
+    if(size < keep + CHUNKSIZE){
+        pthread_mutex_unlock(&sbrk_lock);
+        return 0;
+    }
+    takeout(bp, size);
+    mem_sbrk(-(int)(size-keep));
+    cur->end -= size-keep;
+    cur->heap -= size-keep;
+    if(keep){
+        PUT(HDRP(bp), PACK(keep,0) | PREV_ALLOC);
+        PUT(FTRP(bp), PACK(keep,0));
+        addfirst(bp, keep);
+    }
+    PUT(HDRP(cur->end), PACK(0,1) | (keep ? 0 : PREV_ALLOC));
+    pthread_mutex_unlock(&sbrk_lock);
+    return size-keep;
+}
 
+// gives the whole pages inside every free block of a subtree back to
+// the OS, keeping the links, the zero offset and the boundary tags.
+// returns their size.
+static size_t tree_release(char *node){
+    size_t size;
 
-// static void *find_fit(size_t asize){
-//     void *bp;
-//     int class = classof(asize);
-//     for(int i=class;i<14;i++){
-//         bp = NEXT_CLASS(free_listp, i);
-//         for(;isptr(bp); bp = NEXT_FREE(bp)){
-//             if(asize<=GET_SIZE(HDRP(bp))){
-//                 return bp;
-//             }
-//     }
-//     }
-//     return NULL;
-// }
+    if(node == NULL)
+        return 0;
+    size = GET_SIZE(HDRP(node));
+    return mem_release(node + 2*DSIZE, size - 3*DSIZE)
+        + tree_release(TOPTR(GET(TREE_LEFT(node))))
+        + tree_release(TOPTR(GET(TREE_RIGHT(node))));
+}
 
+#if FIT_POLICY == BOUNDED_FIT
 // finds the best fit free block for a particular size.
+// the own class of the size is probed for at most PROBE_LIMIT blocks,
+// since it may hold blocks smaller than asize. every block in a
+// bigger class fits, so the first non-empty one is taken from the bitmaps.
+// the tree serves big sizes, and small ones when no class has a block.
 static void *find_bestfit(size_t asize){
     void *bp;
-    void* res;
-    int class = classof(asize);
-    int flag=0;
+    void* res = NULL;
+    int fl, sl;
+    int probes;
+    unsigned int map;
     size_t min=INT_MAX;
 
-    for(int i=class;i<14;i++){
-        bp = NEXT_CLASS(free_listp, i);
-        for(;isptr(bp); bp = NEXT_FREE(bp)){
-            if(asize<=GET_SIZE(HDRP(bp))&&GET_SIZE(HDRP(bp))<min){
-                min = GET_SIZE(HDRP(bp));
-                res = bp;
-                flag=1;
-            }
+    if(asize >= TREE_MIN)
+        return tree_bestfit(asize);
+    mapping(asize, &fl, &sl);
+    bp = HEAD(free_listp, fl, sl);
+    for(probes=0; bp!=NULL && probes<PROBE_LIMIT; bp = NEXT_FREE(bp), probes++){
+        if(asize<=GET_SIZE(HDRP(bp))&&GET_SIZE(HDRP(bp))<min){
+            min = GET_SIZE(HDRP(bp));
+            res = bp;
+            if(min==asize) break;
         }
-        if(flag==1) return res;
     }
-    return NULL;
+    if(res!=NULL) return res;
+
+    // bigger second level classes within the same first level class
+    map = GET(SL_BITMAP(free_listp, fl)) & (~0u<<sl<<1);
+    if(!map){
+        // otherwise the smallest non-empty bigger first level class
+        map = GET(FL_BITMAP(free_listp)) & (~0u<<fl<<1);
+        if(!map) return tree_bestfit(asize);
+        fl = lsb(map);
+        map = GET(SL_BITMAP(free_listp, fl));
+    }
+    sl = lsb(map);
+    return HEAD(free_listp, fl, sl);
 }
+#else
+// the block of the class fl/sl that the policy picks for asize, or null.
+// first fit takes the first one that fits, and next fit starts looking
+// at the rover when it is in this class. the best fits scan the class.
+static void *class_fit(int fl, int sl, size_t asize){
+    char *bp = HEAD(free_listp, fl, sl);
+    char *res = NULL;
 
-// allocates a space for 'asize'd memory.
-static void place(void* bp, size_t asize){
-    size_t csize = GET_SIZE(HDRP(bp));
-    void* next_ptr = NEXT_FREE(bp);
-    void* prev_ptr = PREV_FREE(bp);
+#if FIT_POLICY == NEXT_FIT
+    char *start = bp;
+    int rfl, rsl;
+
+    if(cur->rover != NULL){
+        mapping(GET_SIZE(HDRP(cur->rover)), &rfl, &rsl);
+        if(rfl == fl && rsl == sl)
+            start = bp = cur->rover;
+    }
+    do {
+        if(GET_SIZE(HDRP(bp)) >= asize){
+            // the search resumes behind the block it found
+            cur->rover = bp;
+            return bp;
+        }
+        if((bp = NEXT_FREE(bp)) == NULL)
+            bp = HEAD(free_listp, fl, sl);
+    } while(bp != start);
+#else
+    size_t size;
+
+    for(; bp != NULL; bp = NEXT_FREE(bp)){
+        if((size = GET_SIZE(HDRP(bp))) < asize)
+            continue;
+#if FIT_POLICY == FIRST_FIT
+        return bp;
+#elif FIT_POLICY == ADDR_FIT
+        if(res == NULL || size < GET_SIZE(HDRP(res))
+           || (size == GET_SIZE(HDRP(res)) && bp < res))
+            res = bp;
+#else
+        if(res == NULL || size < GET_SIZE(HDRP(res))){
+            res = bp;
+            if(size == asize)
+                break;
+        }
+#endif
+    }
+#endif
+    return res;
+}
+
+// finds a free block for a particular size with the placement policy.
+// the classes that may hold a block that fits are tried from the
+// smallest one up, as the bitmaps give them, then the tree.
+static void *find_bestfit(size_t asize){
+    void *bp;
+    int fl, sl;
+    unsigned int map;
+
+    if(asize >= TREE_MIN)
+        return tree_bestfit(asize);
+    mapping(asize, &fl, &sl);
+    map = GET(SL_BITMAP(free_listp, fl)) & (~0u<<sl);
+    for(;;){
+        for(; map; map &= map-1)
+            if((bp = class_fit(fl, lsb(map), asize)) != NULL)
+                return bp;
+        map = GET(FL_BITMAP(free_listp)) & (~0u<<fl<<1);
+        if(!map)
+            return tree_bestfit(asize);
+        fl = lsb(map);
+        map = GET(SL_BITMAP(free_listp, fl));
+    }
+}
+#endif
+
+// marks 'asize' bytes of the free block bp of csize bytes as allocated.
+// the block must be already taken out of its free list.
+// returns where the known zero bytes of the free block began, or null.
+static char *carve(void* bp, size_t csize, size_t asize){
+    char *zero = ZERO_LO(bp);
 
     // if the size of the free block is quite bigger than 'asize'
     // so that a new free block can be splitted from it.
     if((csize-asize) >= (2*DSIZE)){
         // first 'asize'd block is marked as allocated.
-        PUT(HDRP(bp), PACK(asize,1));
-        PUT(FTRP(bp), PACK(asize, 1));
+        PUT(HDRP(bp), PACK(asize,1) | GET_PREV_ALLOC(HDRP(bp)));
         bp = NEXT_BLKP(bp);
         // leftover is grouped as a new block, marked as unallocated.
-        PUT(HDRP(bp), PACK(csize-asize,0));
+        PUT(HDRP(bp), PACK(csize-asize,0) | PREV_ALLOC);
         PUT(FTRP(bp), PACK(csize-asize,0));
-        // deals with pointers pointing to this block.
-        if(prev_ptr==free_listp) PUTPTR(NEXT_CLASS_PTR(prev_ptr, classof(csize)), next_ptr);
-        else if(prev_ptr!=NULL) PUTPTR(NEXT_PTR(prev_ptr), next_ptr);
-        if(next_ptr!=NULL) PUTPTR(PREV_PTR(next_ptr), prev_ptr);
-        bp = coalesce(bp);
-        addfirst(bp, GET_SIZE(HDRP(bp)));
-        // printf("%u place 1 class %d\n", (unsigned int)bp, classof(csize-asize)+1);
+        set_zero(bp, zero);
+        addfirst(bp, csize-asize);
+        cur->count.splits++;
     }
 
     else{
-        PUT(HDRP(bp), PACK(csize, 1));
-        PUT(FTRP(bp), PACK(csize, 1));
-        if(prev_ptr==free_listp) PUTPTR(NEXT_CLASS_PTR(prev_ptr, classof(csize)), next_ptr);
-        else if(prev_ptr!=NULL) PUTPTR(NEXT_PTR(prev_ptr), next_ptr);
-        if(next_ptr!=NULL) PUTPTR(PREV_PTR(next_ptr), prev_ptr);
+        PUT(HDRP(bp), PACK(csize, 1) | GET_PREV_ALLOC(HDRP(bp)));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
     }
+    return zero;
 }
 
-/*********************************************************
-* main functions
-*********************************************************/
+// allocates a space for 'asize'd memory.
+// returns where the known zero bytes of the free block began, or null.
+static char *place(void* bp, size_t asize){
+    size_t csize = GET_SIZE(HDRP(bp));
 
-/* 
- * mm_init - initialize the malloc package.
- */
-int mm_init(void)
-{
-    mem_init();
-    if ((free_listp = mem_sbrk(18*WSIZE)) == (void *)-1)
-        return -1;
+    takeout(bp, csize);
+    return carve(bp, csize, asize);
+}
 
-    PUT(free_listp, 0);
-    PUT(free_listp + (1*WSIZE), PACK(8*DSIZE, 1)); //prologue header
-    // prologue has only 'next pointers', which points to each first elem of the segregated class.
-    // this free list consists of 14 classes.
-    for(int i=0;i<14;i++){
-        PUT(free_listp + ((i+2)*WSIZE), 0); 
-    }
-    PUT(free_listp + (16*WSIZE), PACK(8*DSIZE, 1)); //prologue footer
-    PUT(free_listp + (17*WSIZE), PACK(0, 1)); // epilogue header
-    free_listp += (2*WSIZE);
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
-        return -1;
-    return 0;
+// the first address in the free block bp aligned to 'align' that leaves
+// room for a free block in front, so 0 or at least 2*DSIZE bytes.
+static char *align_in(char *bp, size_t align){
+    char *abp = (char *)(((size_t)bp + align-1) & ~(align-1));
+
+    if(abp != bp && abp-bp < 2*DSIZE)
+        abp += align;
+    return abp;
 }
 
-/* 
- * mm_malloc - Allocate a block by finding the best fit or extending the heap.
- *     Always allocate a block whose size is a multiple of the alignment.
- */
-void *mm_malloc(size_t size){
-    size_t asize; 
-    size_t extendsize; 
-    char *bp;
-    if (size == 0)
-        return NULL;
-    if (size <= DSIZE)
-        asize = 2*DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+// allocates an 'asize'd block whose payload is aligned to 'align'.
+// the best fit for asize alone is taken if the aligned payload fits in it,
+// otherwise a block big enough for any alignment of it.
+// the slack in front of the aligned payload is returned to the free
+// list as a block of its own, and the rest behind it as usual.
+// if 'zerop' is not null, it gets where the known zero bytes began.
+static void *place_aligned(size_t asize, size_t align, char **zerop){
+    size_t need = asize + align + 2*DSIZE;
+    size_t csize, slack;
+    char *bp, *abp, *zero;
 
-    if ((bp = find_bestfit(asize)) != NULL) {
-        place(bp, asize); 
-        return bp;
-      }
-    // if there is no space in the free list, extend the heap and allocate
-    // memory to the new space(might or might not start from the new heapspace)
-    extendsize = MAX(asize,CHUNKSIZE); 
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-        return NULL;
-    place(bp, asize); 
-    // mm_check();
-    return bp;
+    bp = find_bestfit(asize);
+    if(bp == NULL || align_in(bp, align) + asize > bp + GET_SIZE(HDRP(bp))){
+        if((bp = find_bestfit(need)) == NULL && (bp = top_fit(need)) == NULL
+           && (bp = grow_heap(need)) == NULL)
+            return NULL;
+    }
+    csize = GET_SIZE(HDRP(bp));
+    takeout(bp, csize);
+    zero = ZERO_LO(bp);
+    abp = align_in(bp, align);
+    slack = abp-bp;
+    if(slack){
+        // the free block in front keeps the place of bp
+        PUT(HDRP(bp), PACK(slack,0) | GET_PREV_ALLOC(HDRP(bp)));
+        PUT(FTRP(bp), PACK(slack,0));
+        set_zero(bp, zero);
+        addfirst(bp, slack);
+        cur->count.splits++;
+        PUT(HDRP(abp), PACK(csize-slack,0));
+        set_zero(abp, zero);
     }
+    zero = carve(abp, csize-slack, asize);
+    if(zerop != NULL)
+        *zerop = zero;
+    return abp;
+}
 
+// takes out a run from the list of runs of its class with free slots.
+static void run_unlink(char* run, int c){
+    char* next = TOPTR(GET(RUN_NEXT(run)));
+    char* prev = TOPTR(GET(RUN_PREV(run)));
 
-/*
- * mm_free - Frees a block and coalesce. Then insert it to the beginning of the free list.
- */
-void mm_free(void *ptr)
-{
-    size_t size = GET_SIZE(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0));
-    PUT(FTRP(ptr), PACK(size, 0));
-    ptr = coalesce(ptr);
-    size = GET_SIZE(HDRP(ptr));
-    // after coalescing the free block, insert it to the beginning of the appropriate free list.
-    addfirst(ptr, size);
-    // mm_check();
+    if(next!=NULL) PUTPTR(RUN_PREV(next), prev);
+    if(prev!=NULL) PUTPTR(RUN_NEXT(prev), next);
+    else PUTPTR(RUN_HEAD_PTR(free_listp, c), next);
 }
 
-/*
- * mm_realloc - Use mm_malloc only when constant approach fails.
- *      i.e. when next free block is not big enough,
- *      or when next block is a plain allocated block.
- */
-void *mm_realloc(void *ptr, size_t size)
-{
-    void *oldptr = ptr;
-    void *newptr;
-    size_t copySize;
-    size_t asize;
-    
-    if(size<=0){
-        mm_free(ptr);
-        return NULL;
-    }
-    if(ptr==NULL){
-        return mm_malloc(size);
-    }
+// puts a run in front of the list of runs of its class with free slots.
+static void run_link(char* run, int c){
+    char* next = RUN_HEAD(free_listp, c);
 
-    if (size <= DSIZE)
-        asize = 2*DSIZE;
-    else
-        asize = DSIZE * ((size + (DSIZE) + (DSIZE-1)) / DSIZE);
+    PUTPTR(RUN_NEXT(run), next);
+    PUTPTR(RUN_PREV(run), NULL);
+    if(next!=NULL) PUTPTR(RUN_PREV(next), run);
+    PUTPTR(RUN_HEAD_PTR(free_listp, c), run);
+}
 
-    copySize = GET_SIZE(HDRP(oldptr));
+// makes a new empty run of class c out of an aligned block.
+static char *run_create(int c){
+    char* run;
+    int i, n = SLOTS(c);
 
-    // when asize is smaller than the size of the original block
-    if (asize <= copySize)
-        return ptr;
-    
-    // if next block is unallocated, and its size is big enough
-    if(!GET_ALLOC(HDRP(NEXT_BLKP(ptr))) && GET_SIZE(HDRP(NEXT_BLKP(ptr)))+copySize>=asize){
-        void* next_free = NEXT_BLKP(ptr);
-        size_t nextsize = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-        // gets ready to use the block.. changes pointers pointing to this block.
-        int class = classof(nextsize);
-        if(isptr(PREV_FREE(next_free))) {
-            if(PREV_FREE(next_free)==free_listp) 
-                PUTPTR(NEXT_CLASS_PTR(free_listp, class), NEXT_FREE(next_free));
-            else PUTPTR(NEXT_PTR(PREV_FREE(next_free)), NEXT_FREE(next_free));
-        }
-        if(isptr(NEXT_FREE(next_free))) 
-            PUTPTR(PREV_PTR(NEXT_FREE(next_free)), PREV_FREE(next_free));
-        // the original block has been concatenated with the next free block.
-        copySize += nextsize;
-        PUT(HDRP(ptr), PACK(copySize,1)); 
-        PUT(FTRP(ptr), PACK(copySize,1));
-        return ptr;
-    }
-    // if next block is an epilogue block, extend the heap and use that space
-    if(GET_SIZE(HDRP(NEXT_BLKP(ptr)))==0){
-        void* bp;
-        size_t extendsize = asize - copySize;
-        if ((long)(bp = mem_sbrk(extendsize)) == -1)
-            return NULL;
-        PUT(HDRP(bp), PACK(extendsize, 0)); 
-        PUT(FTRP(bp), PACK(extendsize, 0)); 
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); 
-        // the original block has been concatenated with the new heap space.
-        PUT(HDRP(ptr), PACK(asize,1)); 
-        PUT(FTRP(ptr), PACK(asize,1));
-        return ptr;
-    }
-    
-    // after all tries fail, just call mm_malloc
-    if((newptr = mm_malloc(size))==NULL){
-            return NULL;
+    if((run = place_aligned(RUN_BLOCK, RUN_SIZE, NULL)) == NULL)
+        return NULL;
+    PUT(RUN_NFREE(run), n);
+    PUT(RUN_CLASS(run), c);
+    // bits past the last slot are marked used so they are never handed out.
+    for(i=0;i<BITMAP_WORDS;i++){
+        if(n >= 32*(i+1)) PUT(RUN_BITMAP(run, i), 0);
+        else if(n <= 32*i) PUT(RUN_BITMAP(run, i), ~0u);
+        else PUT(RUN_BITMAP(run, i), ~0u << (n-32*i));
     }
-    memcpy(newptr, ptr, copySize);
-    mm_free(ptr);
-    // mm_check();
-    return newptr;
+    page_class[PAGE_IDX(run)] = c+1;
+    run_link(run, c);
+    return run;
 }
 
+// hands out a free slot of class c.
+static void *run_alloc(int c){
+    char* run = RUN_HEAD(free_listp, c);
+    unsigned int map;
+    int i, bit;
 
+    if(run==NULL && (run = run_create(c)) == NULL)
+        return NULL;
+    for(i=0; (map = ~GET(RUN_BITMAP(run, i))) == 0; i++)
+        ;
+    bit = lsb(map);
+    PUT(RUN_BITMAP(run, i), GET(RUN_BITMAP(run, i)) | (1u<<bit));
+    PUT(RUN_NFREE(run), GET(RUN_NFREE(run))-1);
+    // a full run leaves the list until one of its slots is freed.
+    if(GET(RUN_NFREE(run))==0)
+        run_unlink(run, c);
+    return run + RUN_HDR + (32*i+bit)*SLOT_SIZE(c);
+}
 
+// gives a slot back to its run. an empty run is returned to the
+// free lists unless it is the last run of its class with free slots.
+static void run_free(void* ptr, int c){
+    char* run = RUN_OF(ptr);
+    int slot = ((char *)ptr - run - RUN_HDR)/SLOT_SIZE(c);
+    unsigned int nfree = GET(RUN_NFREE(run));
 
+    PUT(RUN_BITMAP(run, slot/32), GET(RUN_BITMAP(run, slot/32)) & ~(1u<<(slot%32)));
+    PUT(RUN_NFREE(run), ++nfree);
+    if(nfree==1)
+        run_link(run, c);
+    else if(nfree==SLOTS(c) && (GET(RUN_NEXT(run)) || GET(RUN_PREV(run)))){
+        run_unlink(run, c);
+        page_class[PAGE_IDX(run)] = 0;
+        arena_free(run);
+    }
+}
 
+// pushes a block of another arena on the remote queue of that arena.
+// any thread may push, so the head is swapped in with compare and swap.
+static void remote_push(arena_t *a, void *ptr){
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
 
+    do {
+        *(void **)ptr = head;
+    } while(!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// frees every block on the remote queue of the current arena.
+// the queue is taken whole, so popping never races with a push.
+static void remote_drain(void){
+    void *bp, *next;
+
+    if(__atomic_load_n(&cur->remote, __ATOMIC_RELAXED) == NULL)
+        return;
+    bp = __atomic_exchange_n(&cur->remote, NULL, __ATOMIC_ACQUIRE);
+    for(; bp != NULL; bp = next){
+        next = *(void **)bp;
+        arena_free(bp);
+    }
+}
+
+// sets up the index of an empty arena and gives it its first chunk.
+static int arena_init(arena_t *a){
+    char *lp;
+
+    cur = a;
+    if ((lp = arena_sbrk((PROLOGUE_WORDS+2)*WSIZE, 0, NULL)) == NULL)
+        return -1;
+    PUT(HDRP(lp), PACK((PROLOGUE_WORDS+2)*WSIZE, 1) | PREV_ALLOC); //prologue header
+    // prologue has the whole index: the first level bitmap, the second level
+    // bitmaps, and the 'next pointers' to each first elem of the segregated class.
+    // then come the heads of the run lists.
+    // all classes are empty at first.
+    for(int i=0;i<PROLOGUE_WORDS;i++){
+        PUT(lp + (i*WSIZE), 0); 
+    }
+    PUT(lp + (PROLOGUE_WORDS*WSIZE), PACK((PROLOGUE_WORDS+2)*WSIZE, 1)); //prologue footer
+    PUT(lp + ((PROLOGUE_WORDS+1)*WSIZE), PACK(0, 1) | PREV_ALLOC); // epilogue header
+    a->listp = free_listp = lp;
+    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+        return -1;
+    return 0;
+}
+
+// locks an arena and makes it the one the helpers work on.
+static void enter(arena_t *a){
+    pthread_mutex_lock(&a->lock);
+    cur = a;
+    free_listp = a->listp;
+}
+
+static void leave(arena_t *a){
+    pthread_mutex_unlock(&a->lock);
+}
+
+// pushes slab s on the front of a list of slabs of its pool.
+static void slab_link(slab_t **list, slab_t *s){
+    s->prev = NULL;
+    if((s->next = *list) != NULL)
+        s->next->prev = s;
+    *list = s;
+}
+
+static void slab_unlink(slab_t **list, slab_t *s){
+    if(s->prev != NULL)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if(s->next != NULL)
+        s->next->prev = s->prev;
+}
+
+// puts obj back into its slab, under the lock of pool p. a slab that
+// becomes empty is kept as the spare, or given back to mm if there is one.
+static void pool_put(mm_pool_t *p, void *obj){
+    slab_t *s = SLAB_OF(obj);
+
+    *(void **)obj = s->free;
+    s->free = obj;
+    if(s->full){
+        slab_unlink(&p->full, s);
+        slab_link(&p->partial, s);
+        s->full = 0;
+    }
+    if(--s->used > 0)
+        return;
+    slab_unlink(&p->partial, s);
+    if(p->spare == NULL){
+        // the next objects come fresh from the start of the slab again
+        s->free = NULL;
+        s->unused = (char *)s + p->first;
+        p->spare = s;
+    }
+    else
+        mm_free(s);
+}
+
+// takes an object of pool p, under its lock: a freed one first, then one
+// never handed out, from the first slab with room. returns NULL if no
+// slab has room and mm has none for another.
+static void *pool_get(mm_pool_t *p){
+    slab_t *s;
+    void *obj;
+
+    if((s = p->partial) == NULL){
+        if((s = p->spare) != NULL)
+            p->spare = NULL;
+        else if((s = mm_memalign(POOL_SLAB, POOL_SLAB)) != NULL){
+            s->free = NULL;
+            s->unused = (char *)s + p->first;
+            s->used = 0;
+            s->full = 0;
+        }
+        else
+            return NULL;
+        slab_link(&p->partial, s);
+    }
+    if((obj = s->free) != NULL)
+        s->free = *(void **)obj;
+    else {
+        obj = s->unused;
+        s->unused += p->size;
+    }
+    s->used++;
+    if(s->free == NULL && s->unused + p->size > (char *)s + POOL_SLAB){
+        slab_unlink(&p->partial, s);
+        slab_link(&p->full, s);
+        s->full = 1;
+    }
+    return obj;
+}
+
+// returns all objects the cache c holds to their pool, if it still exists.
+static void pcache_flush(pcache_t *c){
+    mm_pool_t *p;
+    void *obj;
+
+    if(c->id == 0)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    for(p = pools; p != NULL && p->id != c->id; p = p->next)
+        ;
+    if(p != NULL){
+        pthread_mutex_lock(&p->lock);
+        while((obj = c->head) != NULL){
+            c->head = *(void **)obj;
+            pool_put(p, obj);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    c->id = 0;
+    c->head = NULL;
+    c->count = 0;
+}
+
+
+// gives every block of the calling thread's cache back to its arena,
+// along with the remote queue of the arena. runs when a thread exits.
+static void tcache_flush(void *arg){
+    void *bp;
+
+    if(tcache.epoch != epoch || tcache.home == NULL)
+        return;
+    // may free slabs, so before the lock of the arena
+    for(int i=0;i<POOL_CACHES;i++)
+        pcache_flush(&tcache.pool[i]);
+    enter(tcache.home);
+    remote_drain();
+    for(int i=0;i<TCACHE_BINS;i++){
+        while((bp = tcache.head[i]) != NULL){
+            tcache.head[i] = *(void **)bp;
+            arena_free(bp);
+        }
+        tcache.count[i] = 0;
+    }
+    leave(tcache.home);
+}
+
+// bytes until the next sample of the calling thread, drawn from the
+// exponential distribution with mean prof_rate, or LONG_MAX when
+// sampling is off.
+static long prof_interval(void){
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    double u;
+
+    if(rate == 0)
+        return LONG_MAX;
+    // xorshift64*, seeded by the address of the cache of the thread
+    if(tcache.seed == 0)
+        tcache.seed = (size_t)&tcache | 1;
+    tcache.seed ^= tcache.seed >> 12;
+    tcache.seed ^= tcache.seed << 25;
+    tcache.seed ^= tcache.seed >> 27;
+    u = ((tcache.seed * 2685821657736338717ull) >> 11) * 0x1.0p-53;
+    return (long)(-log(1 - u) * rate) + 1;
+}
+
+// slot of the table where bp is, or the empty slot where it would go.
+static sample_t *prof_slot(void *bp){
+    size_t i;
+
+    for(i = PROF_HASH(bp); prof_table[i].bp != NULL && prof_table[i].bp != bp; i = (i+1) & (PROF_SLOTS-1))
+        ;
+    return &prof_table[i];
+}
+
+// records the block bp of 'size' bytes in the profile, with the call path
+// from the caller of mm at ret up. the backtrace is taken first, as it
+// may allocate.
+static void prof_sample(void *bp, size_t size, void *ret){
+    void *frames[PROF_DEPTH+4];
+    sample_t *sp;
+    int n, i;
+
+    tcache.sample = prof_interval();
+    n = backtrace(frames, PROF_DEPTH+4);
+    // the frames of mm come first
+    for(i = 0; i < n && frames[i] != ret; i++)
+        ;
+    if(i == n){
+        frames[0] = ret;
+        i = 0;
+        n = 1;
+    }
+    pthread_mutex_lock(&prof_lock);
+    // the table keeps an empty slot, which ends every probe
+    if(prof_count == PROF_SLOTS-1){
+        prof_dropped++;
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    sp = prof_slot(bp);
+    sp->bp = bp;
+    sp->size = size;
+    for(sp->depth = 0; sp->depth < PROF_DEPTH && i < n; sp->depth++)
+        sp->stack[sp->depth] = frames[i++];
+    prof_count++;
+    if(IS_MAPPED(bp))
+        __atomic_fetch_add(&mapped_sampled, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&page_sampled[PAGE_IDX(bp)], 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// counts 'size' bytes allocated at bp for the caller at ret against the
+// interval of the thread, and samples bp when the interval runs out.
+static inline void *prof_alloc(void *bp, size_t size, void *ret){
+    if((tcache.sample -= (long)size) <= 0 && bp != NULL)
+        prof_sample(bp, size, ret);
+    return bp;
+}
+
+// empties the slot sp of the table, under the lock. later entries of its
+// probe move up into the gap.
+static void prof_remove(sample_t *sp){
+    size_t i = sp - prof_table, j;
+
+    prof_count--;
+    if(IS_MAPPED(sp->bp))
+        __atomic_fetch_sub(&mapped_sampled, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_sub(&page_sampled[PAGE_IDX(sp->bp)], 1, __ATOMIC_RELAXED);
+    for(j = (i+1) & (PROF_SLOTS-1); prof_table[j].bp != NULL; j = (j+1) & (PROF_SLOTS-1)){
+        // the entry at j moves into the gap at i, unless its home
+        // slot lies after the gap, up to j
+        if(((j - PROF_HASH(prof_table[j].bp)) & (PROF_SLOTS-1)) >= ((j - i) & (PROF_SLOTS-1))){
+            prof_table[i] = prof_table[j];
+            i = j;
+        }
+    }
+    prof_table[i].bp = NULL;
+}
+
+// drops the sample of bp from the table, if it has one.
+static void prof_forget(void *bp){
+    sample_t *sp;
+
+    pthread_mutex_lock(&prof_lock);
+    if((sp = prof_slot(bp))->bp != NULL)
+        prof_remove(sp);
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// moves the sample of bp, if it has one, to the block newbp of 'size'
+// bytes that realloc made of it, and returns whether it had one. the
+// call path stays that of bp.
+static int prof_move(void *bp, void *newbp, size_t size){
+    sample_t *sp, s;
+    int found;
+
+    pthread_mutex_lock(&prof_lock);
+    if((found = (sp = prof_slot(bp))->bp != NULL)){
+        s = *sp;
+        prof_remove(sp);
+        s.bp = newbp;
+        s.size = size;
+        *prof_slot(newbp) = s;
+        prof_count++;
+        if(IS_MAPPED(newbp))
+            __atomic_fetch_add(&mapped_sampled, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&page_sampled[PAGE_IDX(newbp)], 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return found;
+}
+
+// whether bp may have a sample: the table is only searched when the page
+// of bp has one.
+static inline int prof_maybe(void *bp){
+    return IS_MAPPED(bp) ? __atomic_load_n(&mapped_sampled, __ATOMIC_RELAXED) != 0
+        : __atomic_load_n(&page_sampled[PAGE_IDX(bp)], __ATOMIC_RELAXED) != 0;
+}
+
+// drops the sample of a block that is about to be freed, if it has one.
+static inline void prof_free(void *bp){
+    if(prof_maybe(bp))
+        prof_forget(bp);
+}
+
+// empties the profile for a new heap. the rate stays.
+static void prof_reset(void){
+    pthread_mutex_lock(&prof_lock);
+    for(int i=0;i<PROF_SLOTS && prof_count>0;i++){
+        if(prof_table[i].bp != NULL){
+            prof_table[i].bp = NULL;
+            prof_count--;
+        }
+    }
+    memset(page_sampled, 0, sizeof(page_sampled));
+    mapped_sampled = 0;
+    prof_dropped = 0;
+    pthread_mutex_unlock(&prof_lock);
+}
+
+static void init_locks(void){
+    for(int i=0;i<NARENAS;i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+// returns the arena of the calling thread. on the first call since
+// mm_init, the thread is tied to the next arena, round robin.
+static arena_t *home_arena(void){
+    arena_t *a;
+
+    if(tcache.epoch == epoch)
+        return tcache.home;
+    memset(&tcache, 0, sizeof(tcache));
+    tcache.sample = prof_interval();
+    a = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NARENAS];
+    pthread_mutex_lock(&a->lock);
+    if(a->listp == NULL && arena_init(a) < 0){
+        pthread_mutex_unlock(&a->lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&a->lock);
+    tcache.home = a;
+    tcache.epoch = epoch;
+    pthread_setspecific(tcache_key, &tcache);
+    return a;
+}
+
+// bin of the thread cache for a request size, or -1 if not cached.
+static inline int tcache_bin(size_t size){
+    if(size <= RUN_MAX)
+        return SMALL_CLASS(size);
+    size = ASIZE(size);
+    return size <= TCACHE_MAX ? size/DSIZE : -1;
+}
+
+// allocates a block in a region of its own.
+static void *mapped_malloc(size_t size){
+    char *p;
+
+    pthread_mutex_lock(&sbrk_lock);
+    if((p = mem_map(size + MMAP_HDR)) != NULL)
+        mapped_bytes += size + MMAP_HDR;
+    pthread_mutex_unlock(&sbrk_lock);
+    if(p == NULL)
+        return NULL;
+    *(size_t *)p = size + MMAP_HDR;
+    return p + MMAP_HDR;
+}
+
+// resizes the region of a mapped block. its pages move without a copy.
+// a block that shrinks by a page or more gives those pages back.
+static void *mapped_realloc(void *ptr, size_t size){
+    size_t old = MMAP_SIZE(ptr);
+    char *p;
+
+    if(size + MMAP_HDR <= old && old - (size + MMAP_HDR) < mem_pagesize())
+        return ptr;
+    pthread_mutex_lock(&sbrk_lock);
+    if((p = mem_remap((char *)ptr - MMAP_HDR, size + MMAP_HDR)) != NULL)
+        mapped_bytes += size + MMAP_HDR - old;
+    pthread_mutex_unlock(&sbrk_lock);
+    if(p == NULL)
+        return NULL;
+    *(size_t *)p = size + MMAP_HDR;
+    return p + MMAP_HDR;
+}
+
+// gives the region of a mapped block back at once.
+static void mapped_free(void *ptr){
+    pthread_mutex_lock(&sbrk_lock);
+    mapped_bytes -= MMAP_SIZE(ptr);
+    mem_unmap((char *)ptr - MMAP_HDR);
+    pthread_mutex_unlock(&sbrk_lock);
+}
+
+// usable bytes of an allocated block or slot.
+static size_t usable_size(void *ptr){
+    int c;
+
+    if(IS_MAPPED(ptr))
+        return MMAP_SIZE(ptr) - MMAP_HDR;
+    c = page_class[PAGE_IDX(ptr)];
+    if(c)
+        return SLOT_SIZE(c-1);
+    return GET_SIZE_ATOMIC(HDRP(ptr)) - WSIZE;
+}
+
+// cuts the allocated block bp of csize bytes down to asize bytes, and
+// frees the surplus when it can make a block of its own. the next block
+// must know bp as allocated.
+static void shrink(void *bp, size_t csize, size_t asize){
+    char *rest;
+
+    if(csize-asize < 2*DSIZE)
+        return;
+    // the owner reads the size without a lock, and the headroom of its
+    // block may be taken back by another thread of the arena.
+    __atomic_store_n((unsigned int *)HDRP(bp), PACK(asize,1) | (GET(HDRP(bp)) & (PREV_ALLOC|GROWN)), __ATOMIC_RELAXED);
+    rest = NEXT_BLKP(bp);
+    PUT(HDRP(rest), PACK(csize-asize,0) | PREV_ALLOC);
+    PUT(FTRP(rest), PACK(csize-asize,0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(rest)));
+    cur->count.splits++;
+    rest = coalesce(rest);
+    addfirst(rest, GET_SIZE(HDRP(rest)));
+}
+
+// returns the entry of the block bp in the headroom list of the
+// current arena, or null if it has none.
+static headroom_t *headroom_find(char *bp){
+    for(int i=0;i<cur->nroom;i++)
+        if(cur->room[i].bp == bp)
+            return &cur->room[i];
+    return NULL;
+}
+
+// drops an entry of the headroom list. its block keeps its size.
+static void headroom_drop(headroom_t *h){
+    *h = cur->room[--cur->nroom];
+}
+
+// cuts the block of an entry back to the size it needs, and drops
+// the entry. the headroom goes to the free lists.
+static void headroom_reclaim(headroom_t *h){
+    char *bp = h->bp;
+    size_t asize = h->asize;
+
+    headroom_drop(h);
+    shrink(bp, GET_SIZE(HDRP(bp)), asize);
+}
+
+// lists a block that realloc has given headroom. when the list is full,
+// the first entry gives its headroom back to make room.
+static void headroom_add(char *bp, size_t asize){
+    if(cur->nroom == HEADROOM_SLOTS)
+        headroom_reclaim(&cur->room[0]);
+    cur->room[cur->nroom].bp = bp;
+    cur->room[cur->nroom].asize = asize;
+    cur->nroom++;
+}
+
+// bounds the headroom of the block bp of csize bytes that realloc grew in
+// place for 'size' bytes to what a moved block gets, as much again as the
+// request, and lists it. the surplus goes back to the free lists, or to
+// the top block when it was taken from there.
+static void headroom_keep(char *bp, size_t csize, size_t size){
+    size_t asize = ASIZE(size);
+
+    shrink(bp, csize, MIN(csize, ASIZE(2*size)));
+    if(GET_SIZE(HDRP(bp)) > asize)
+        headroom_add(bp, asize);
+}
+
+// drops the entry of an allocated block that is about to be freed.
+static void headroom_forget(char *bp){
+    headroom_t *h;
+
+    if((GET(HDRP(bp)) & GROWN) && (h = headroom_find(bp)) != NULL)
+        headroom_drop(h);
+}
+
+// takes back the headroom of a block that has at least asize bytes of it,
+// so the free lists can serve asize bytes without growing the heap.
+// returns whether there was one.
+static int headroom_release(size_t asize){
+    headroom_t *h;
+
+    for(h = cur->room; h < cur->room+cur->nroom; h++){
+        if(GET_SIZE(HDRP(h->bp)) - h->asize >= asize){
+            headroom_reclaim(h);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// clears the first 'size' bytes of the block bp just carved out of a free
+// block, but for those known to be zero from 'zero' on, if it is not null.
+static void clear_carved(char *bp, size_t size, char *zero){
+    if (zero == NULL || zero >= bp + size)
+        memset(bp, 0, size);
+    else {
+        memset(bp, 0, zero - bp);
+        // the old footer of the free block may lie in the payload
+        PUT(bp + GET_SIZE(HDRP(bp)) - DSIZE, 0);
+    }
+}
+
+// mm_malloc of the current arena. if 'clear' is set, the first 'size'
+// bytes of the payload are cleared, but for those known to be zero.
+static void *arena_malloc(size_t size, int clear){
+    size_t asize; 
+    char *bp, *zero;
+    if (size <= RUN_MAX) {
+        bp = run_alloc(SMALL_CLASS(size));
+        if (clear && bp != NULL)
+            memset(bp, 0, size);
+        return bp;
+    }
+    asize = ASIZE(size);
+
+    // the top block serves when no other free block fits.
+    // under memory pressure, blocks with headroom give it back first.
+    // if there is still no space in the free list, extend the heap and allocate
+    // memory to the new space(might or might not start from the new heapspace)
+    if ((bp = find_bestfit(asize)) == NULL && (bp = top_fit(asize)) == NULL
+        && (!headroom_release(asize) || (bp = find_bestfit(asize)) == NULL)) {
+        if ((bp = grow_heap(asize)) == NULL)
+            return NULL;
+    }
+    else
+        heap_quiet();
+    zero = place(bp, asize); 
+    if (clear)
+        clear_carved(bp, size, zero);
+    return bp;
+    }
+
+// mm_free of the current arena, which owns ptr.
+static void arena_free(void *ptr){
+    size_t size;
+    int c = page_class[PAGE_IDX(ptr)];
+
+    // slots of a run have no header, their class comes from the page.
+    if(c){
+        run_free(ptr, c-1);
+        return;
+    }
+    headroom_forget(ptr);
+    size = GET_SIZE(HDRP(ptr));
+    PUT(HDRP(ptr), PACK(size, 0) | GET_PREV_ALLOC(HDRP(ptr)));
+    PUT(FTRP(ptr), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+    ptr = coalesce(ptr);
+    size = GET_SIZE(HDRP(ptr));
+    // after coalescing the free block, insert it to the beginning of the appropriate free list.
+    addfirst(ptr, size);
+}
+
+// mm_malloc_batch of the current arena. the n blocks are carved in a row
+// out of one free block of n times their size, which is split only once.
+// slots come from their runs one by one.
+static int arena_malloc_batch(size_t size, int n, void **out){
+    size_t asize, total, csize;
+    unsigned int prev;
+    char *bp, *zero;
+    int i;
+
+    if (size <= RUN_MAX) {
+        for (i = 0; i < n && (out[i] = run_alloc(SMALL_CLASS(size))) != NULL; i++)
+            ;
+        return i;
+    }
+    asize = ASIZE(size);
+    total = asize*n;
+    // a block size must fit in a header
+    if (total/n != asize || total >= (1u<<31))
+        bp = NULL;
+    else if ((bp = find_bestfit(total)) == NULL && (bp = top_fit(total)) == NULL
+        && (!headroom_release(total) || (bp = find_bestfit(total)) == NULL))
+        bp = grow_heap(total);
+    if (bp == NULL) {
+        for (i = 0; i < n && (out[i] = arena_malloc(size, 0)) != NULL; i++)
+            ;
+        return i;
+    }
+    csize = GET_SIZE(HDRP(bp));
+    takeout(bp, csize);
+    zero = ZERO_LO(bp);
+    prev = GET_PREV_ALLOC(HDRP(bp));
+    for (i = 0; i < n-1; i++) {
+        PUT(HDRP(bp), PACK(asize,1) | prev);
+        prev = PREV_ALLOC;
+        out[i] = bp;
+        bp += asize;
+        csize -= asize;
+    }
+    // the last block takes what is left, and hands the rest back as usual
+    PUT(HDRP(bp), PACK(csize,0) | prev);
+    set_zero(bp, zero);
+    carve(bp, csize, asize);
+    out[n-1] = bp;
+    return n;
+}
+
+// mm_free_batch of the current arena, which owns the n blocks of ptrs,
+// sorted by address. blocks that lie next to each other are merged into
+// one free block before it is coalesced and put in the free lists.
+static void arena_free_batch(void **ptrs, int n){
+    char *bp;
+    size_t size;
+    int i, j, c;
+
+    for (i = 0; i < n; i = j) {
+        bp = ptrs[i];
+        j = i+1;
+        if ((c = page_class[PAGE_IDX(bp)]) != 0) {
+            run_free(bp, c-1);
+            continue;
+        }
+        headroom_forget(bp);
+        size = GET_SIZE(HDRP(bp));
+        for (; j < n && (char *)ptrs[j] == bp+size && !page_class[PAGE_IDX(ptrs[j])]; j++) {
+            headroom_forget(ptrs[j]);
+            size += GET_SIZE(HDRP(ptrs[j]));
+            cur->count.coalesces++;
+        }
+        PUT(HDRP(bp), PACK(size, 0) | GET_PREV_ALLOC(HDRP(bp)));
+        PUT(FTRP(bp), PACK(size, 0));
+        CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+        bp = coalesce(bp);
+        addfirst(bp, GET_SIZE(HDRP(bp)));
+    }
+}
+
+// mm_realloc of the current arena, which owns ptr.
+// uses arena_malloc only when constant approach fails.
+// 'old' gets the usable size of ptr without its headroom.
+static void *arena_realloc(void *ptr, size_t size, size_t *old){
+    void *oldptr = ptr;
+    void *newptr;
+    char *prev, *next;
+    headroom_t *h;
+    size_t copySize;
+    size_t asize, total, grow, room;
+    unsigned int grown;
+
+    // a slot can only stay in place if the new size fits in it.
+    if(page_class[PAGE_IDX(ptr)]){
+        copySize = SLOT_SIZE(page_class[PAGE_IDX(ptr)]-1);
+        *old = copySize;
+        if(size <= copySize)
+            return ptr;
+        if((newptr = arena_malloc(size, 0))==NULL)
+            return NULL;
+        memcpy(newptr, ptr, copySize);
+        arena_free(ptr);
+        return newptr;
+    }
+
+    asize = ASIZE(size);
+
+    copySize = GET_SIZE(HDRP(oldptr));
+    grown = GET(HDRP(ptr)) & GROWN;
+    *old = copySize - WSIZE;
+
+    // a block with headroom stays as it is while the new size fits in it.
+    // once it outgrows it, the block is no longer listed.
+    if(grown && (h = headroom_find(ptr)) != NULL){
+        *old = h->asize - WSIZE;
+        if(asize <= copySize){
+            h->asize = MAX(asize, ASIZE(RUN_MAX+1));
+            return ptr;
+        }
+        headroom_drop(h);
+    }
+
+    // when asize is smaller than the size of the original block,
+    // the tail goes back to the free lists. a block never gets as small
+    // as a slot, since the thread cache bins of slots are keyed by size.
+    if (asize <= copySize){
+        shrink(ptr, copySize, MAX(asize, ASIZE(RUN_MAX+1)));
+        return ptr;
+    }
+    
+    // if next block is unallocated, and its size is big enough
+    if(!GET_ALLOC(HDRP(NEXT_BLKP(ptr))) && GET_SIZE(HDRP(NEXT_BLKP(ptr)))+copySize>=asize){
+        size_t nextsize = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+        // gets ready to use the block.. takes it out of its free list.
+        takeout(NEXT_BLKP(ptr), nextsize);
+        // the original block has been concatenated with the next free block.
+        PUT(HDRP(ptr), PACK(copySize+nextsize,1) | GROWN | GET_PREV_ALLOC(HDRP(ptr))); 
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+        headroom_keep(ptr, copySize+nextsize, size);
+        return ptr;
+    }
+    // if next block is an epilogue block at the top of the heap, or the
+    // free top block that is too small, extend the heap and use that space.
+    // the heap grows by a chunk, and what the block does not need yet
+    // is listed as its headroom.
+    next = NEXT_BLKP(ptr);
+    if(next==cur->end || next==cur->top){
+        room = next==cur->top ? GET_SIZE(HDRP(next)) : 0;
+        grow = grow_size(asize - copySize - room, 0);
+        if(arena_sbrk(grow, 1, NULL) != NULL
+           || (grow > asize - copySize - room
+               && arena_sbrk(grow = asize - copySize - room, 1, NULL) != NULL)){
+            if(room)
+                takeout(next, room);
+            // the original block has been concatenated with the new heap space.
+            PUT(HDRP(ptr), PACK(copySize + room + grow,1) | GROWN | GET_PREV_ALLOC(HDRP(ptr))); 
+            PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, 1) | PREV_ALLOC); 
+            if(copySize + room + grow > asize)
+                headroom_add(ptr, asize);
+            return ptr;
+        }
+    }
+    // if the previous block is unallocated, it is concatenated with the
+    // original block, and with the next block if that is free too.
+    // the payload moves down to the start of the previous block.
+    // like the next block above, it keeps bounded headroom for more growth.
+    if(!GET_PREV_ALLOC(HDRP(ptr))){
+        prev = PREV_BLKP(ptr);
+        total = GET_SIZE(HDRP(prev)) + copySize;
+        if(!GET_ALLOC(HDRP(NEXT_BLKP(ptr))))
+            total += GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+        if(total >= asize){
+            takeout(prev, GET_SIZE(HDRP(prev)));
+            if(!GET_ALLOC(HDRP(NEXT_BLKP(ptr))))
+                takeout(NEXT_BLKP(ptr), GET_SIZE(HDRP(NEXT_BLKP(ptr))));
+            // the block before a free block is always allocated
+            PUT(HDRP(prev), PACK(total,1) | GROWN | PREV_ALLOC);
+            memmove(prev, ptr, copySize-WSIZE);
+            SET_PREV_ALLOC(HDRP(NEXT_BLKP(prev)));
+            headroom_keep(prev, total, size);
+            return prev;
+        }
+    }
+    
+    // after all tries fail, just call arena_malloc.
+    // a block that has grown before gets headroom when there is memory for it.
+    newptr = grown ? arena_malloc(2*size, 0) : NULL;
+    if(newptr != NULL)
+        headroom_add(newptr, asize);
+    else if((newptr = arena_malloc(size, 0))==NULL){
+            return NULL;
+    }
+    PUT(HDRP(newptr), GET(HDRP(newptr)) | GROWN);
+    // the header of the old block is not a part of its payload
+    memcpy(newptr, ptr, copySize-WSIZE);
+    arena_free(ptr);
+    return newptr;
+}
+
+/*********************************************************
+* main functions
+*********************************************************/
+
+/* 
+ * mm_init - initialize the malloc package.
+ *     Threads other than the caller must not use blocks of an earlier heap.
+ */
+int mm_init(void)
+{
+    char *bp;
+
+    pthread_once(&init_once, init_locks);
+    heap_lo = mem_heap_lo();
+    heap_page = mem_heap_pagesize();
+    memset(page_class, 0, sizeof(page_class));
+    memset(page_arena, 0, sizeof(page_arena));
+    for(int i=0;i<NARENAS;i++){
+        arenas[i].listp = NULL;
+        arenas[i].end = NULL;
+        arenas[i].remote = NULL;
+        arenas[i].id = i;
+        arenas[i].nroom = 0;
+        arenas[i].rover = NULL;
+        arenas[i].top = NULL;
+        arenas[i].chunk = CHUNKSIZE;
+        arenas[i].heap = 0;
+        arenas[i].quiet = 0;
+        memset(&arenas[i].count, 0, sizeof(counters_t));
+    }
+    epoch++;
+    next_arena = 1;
+    mapped_bytes = 0;
+    pools = NULL;
+    memset(&tcache, 0, sizeof(tcache));
+    tcache.home = &arenas[0];
+    tcache.epoch = epoch;
+    tcache.sample = prof_interval();
+    prof_reset();
+
+    // the arena of the caller starts at the bottom of the heap with
+    // a padding word, so its prologue needs no fence.
+    if ((bp = mem_sbrk(DSIZE)) == (void *)-1)
+        return -1;
+    PUT(bp, 0);
+    arenas[0].end = bp + DSIZE;
+    enter(&arenas[0]);
+    if (arena_init(&arenas[0]) < 0){
+        leave(&arenas[0]);
+        return -1;
+    }
+    leave(&arenas[0]);
+    return 0;
+}
+
+// mm_malloc and mm_calloc. a mapped block is fresh from memlib, so it is
+// zero already.
+static void *home_malloc(size_t size, int clear){
+    arena_t *a;
+    void *bp;
+    int bin;
+
+    if (size == 0)
+        return NULL;
+    if (size >= MMAP_THRESHOLD)
+        return mapped_malloc(size);
+    if ((a = home_arena()) == NULL)
+        return NULL;
+    bin = tcache_bin(size);
+    if (bin >= 0 && (bp = tcache.head[bin]) != NULL) {
+        tcache.head[bin] = *(void **)bp;
+        tcache.count[bin]--;
+        if (clear)
+            memset(bp, 0, size);
+        return bp;
+    }
+    enter(a);
+    remote_drain();
+    bp = arena_malloc(size, clear);
+    // mm_check();
+    leave(a);
+    return bp;
+}
+
+/* 
+ * mm_malloc - Allocate a block by finding the best fit or extending the heap.
+ *     Always allocate a block whose size is a multiple of the alignment.
+ *     A block of the same size in the thread cache is taken without locking.
+ *     Otherwise the blocks other threads freed to the arena are freed first.
+ */
+void *mm_malloc(size_t size){
+    return prof_alloc(home_malloc(size, 0), size, CALLER);
+    }
+
+/*
+ * mm_calloc - Allocate a cleared array of nmemb elements of 'size' bytes.
+ *     Free blocks remember how many of their last bytes are still zero since
+ *     memlib handed them out, and those bytes are not cleared again.
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > (size_t)-1 / nmemb)
+        return NULL;
+    return prof_alloc(home_malloc(nmemb * size, 1), nmemb * size, CALLER);
+}
+
+// mm_memalign and mm_calloc_aligned. if 'clear' is set, the payload is
+// cleared as in home_malloc.
+static void *home_memalign(size_t align, size_t size, int clear){
+    arena_t *a;
+    char *bp, *zero;
+    int bin;
+
+    if (align == 0 || (align & (align-1)) || align >= MAX_HEAP)
+        return NULL;
+    if (align <= ALIGNMENT)
+        return home_malloc(size, clear);
+    // runs start on a page with a header of a multiple of 2*DSIZE bytes,
+    // so a slot whose size is a multiple of align is aligned as well
+    if (align <= 2*DSIZE && size <= RUN_MAX && size > 0)
+        return home_malloc((size + align-1) & ~(align-1), clear);
+    // so is the payload of a mapped block, after its header
+    if (align <= MMAP_HDR && size >= MMAP_THRESHOLD)
+        return mapped_malloc(size);
+    if (size == 0 || size >= MAX_HEAP)
+        return NULL;
+    if ((a = home_arena()) == NULL)
+        return NULL;
+    // a block of the thread cache is taken if it happens to be aligned
+    bin = tcache_bin(size);
+    if (bin >= 0 && (bp = tcache.head[bin]) != NULL && ((size_t)bp & (align-1)) == 0) {
+        tcache.head[bin] = *(void **)bp;
+        tcache.count[bin]--;
+        if (clear)
+            memset(bp, 0, size);
+        return bp;
+    }
+    enter(a);
+    remote_drain();
+    // like the blocks realloc shrinks, it must not be as small as a slot
+    bp = place_aligned(MAX(ASIZE(size), ASIZE(RUN_MAX+1)), align, &zero);
+    if (clear && bp != NULL)
+        clear_carved(bp, size, zero);
+    // mm_check();
+    leave(a);
+    return bp;
+}
+
+/*
+ * mm_memalign - Allocate a block whose payload is aligned to 'align', a
+ *     power of two. The aligned payload is carved out of a free block,
+ *     and the slack in front of it and behind it goes back to the free
+ *     lists. Small requests aligned to at most 16 bytes are served from
+ *     the runs of a size that is a multiple of the alignment, and a block
+ *     of the thread cache is taken if it is aligned. Huge requests aligned
+ *     to at most 16 bytes get a region of their own as in mm_malloc. Other
+ *     aligned blocks always come from the heap.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    return prof_alloc(home_memalign(align, size, 0), size, CALLER);
+}
+
+/*
+ * mm_calloc_aligned - Allocate a cleared array of nmemb elements of 'size'
+ *     bytes, aligned like mm_memalign. As in mm_calloc, the bytes known to
+ *     be zero are not cleared again.
+ */
+void *mm_calloc_aligned(size_t align, size_t nmemb, size_t size)
+{
+    if (nmemb != 0 && size > (size_t)-1 / nmemb)
+        return NULL;
+    return prof_alloc(home_memalign(align, nmemb * size, 1), nmemb * size, CALLER);
+}
+
+/*
+ * mm_usable_size - Returns how many bytes of the payload of a block can be
+ *     used. The headroom of a block realloc has grown may be taken back at
+ *     any time, so it only counts the size the block needs, which takes the
+ *     lock of its arena.
+ */
+size_t mm_usable_size(void *ptr)
+{
+    arena_t *a;
+    headroom_t *h;
+    size_t size;
+
+    if (ptr == NULL)
+        return 0;
+    if (IS_MAPPED(ptr) || page_class[PAGE_IDX(ptr)] || !(GET_ATOMIC(HDRP(ptr)) & GROWN))
+        return usable_size(ptr);
+    a = &arenas[page_arena[PAGE_IDX(ptr)]];
+    enter(a);
+    size = (h = headroom_find(ptr)) != NULL ? h->asize - WSIZE : usable_size(ptr);
+    leave(a);
+    return size;
+}
+
+/*
+ * mm_malloc_batch - Allocate n blocks of 'size' bytes into out[0..n-1].
+ *     The blocks are carved in a row from one free block under a single
+ *     lock, without the thread cache. Returns how many blocks were
+ *     allocated, which is less than n only when memory ran out.
+ */
+int mm_malloc_batch(size_t size, int n, void **out)
+{
+    arena_t *a;
+    int i, k;
+
+    if (size == 0 || n <= 0)
+        return 0;
+    if (size >= MMAP_THRESHOLD) {
+        for (i = 0; i < n && (out[i] = mapped_malloc(size)) != NULL; i++)
+            ;
+    }
+    else {
+        if ((a = home_arena()) == NULL)
+            return 0;
+        enter(a);
+        remote_drain();
+        i = arena_malloc_batch(size, n, out);
+        // mm_check();
+        leave(a);
+    }
+    for (k = 0; k < i; k++)
+        prof_alloc(out[k], size, CALLER);
+    return i;
+}
+
+
+// mm_free, without the bookkeeping of the profile.
+static void home_free(void *ptr)
+{
+    arena_t *a, *owner;
+    unsigned int hdr;
+    int c, bin;
+
+    if(ptr==NULL)
+        return;
+    if(IS_MAPPED(ptr)){
+        mapped_free(ptr);
+        return;
+    }
+    a = home_arena();
+    owner = &arenas[page_arena[PAGE_IDX(ptr)]];
+    if(owner == a){
+        c = page_class[PAGE_IDX(ptr)];
+        hdr = c ? 0 : GET_ATOMIC(HDRP(ptr));
+        // a grown block may be in the headroom list, which needs the lock
+        if(c)
+            bin = c-1;
+        else if(!(hdr & GROWN) && (hdr & ~0x7) <= TCACHE_MAX)
+            bin = (hdr & ~0x7)/DSIZE;
+        else
+            bin = -1;
+        if(bin >= 0 && tcache.count[bin] < TCACHE_COUNT){
+            *(void **)ptr = tcache.head[bin];
+            tcache.head[bin] = ptr;
+            tcache.count[bin]++;
+            return;
+        }
+    }
+    else {
+        remote_push(owner, ptr);
+        return;
+    }
+    enter(owner);
+    arena_free(ptr);
+    // mm_check();
+    leave(owner);
+}
+
+/*
+ * mm_free - Frees a block and coalesce. Then insert it to the beginning of the free list.
+ *     Blocks of the thread's own arena go to the thread cache while it has room.
+ *     Blocks of other arenas go to the remote queue of their arena.
+ *     Mapped blocks are unmapped at once.
+ */
+void mm_free(void *ptr)
+{
+    if(ptr==NULL)
+        return;
+    prof_free(ptr);
+    home_free(ptr);
+}
+
+static int addr_cmp(const void *a, const void *b){
+    char *x = *(char **)a, *y = *(char **)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * mm_free_batch - Frees the n blocks of ptrs, which it sorts by address.
+ *     The blocks of the thread's arena are freed under a single lock, and
+ *     the ones next to each other are merged before they are coalesced.
+ *     Other blocks are freed as mm_free does, but for the thread cache.
+ */
+void mm_free_batch(void **ptrs, int n)
+{
+    arena_t *a, *owner;
+    int i, k = 0;
+
+    if(n <= 0)
+        return;
+    // a thread without an arena owns none of the blocks, so it frees
+    // them all to their owners as mm_free does
+    a = home_arena();
+    qsort(ptrs, n, sizeof(void *), addr_cmp);
+    // the blocks of the arena are moved to the front, still sorted
+    for(i = 0; i < n; i++){
+        if(ptrs[i] == NULL)
+            continue;
+        prof_free(ptrs[i]);
+        if(IS_MAPPED(ptrs[i])){
+            mapped_free(ptrs[i]);
+            continue;
+        }
+        owner = &arenas[page_arena[PAGE_IDX(ptrs[i])]];
+        if(owner == a)
+            ptrs[k++] = ptrs[i];
+        else
+            remote_push(owner, ptrs[i]);
+    }
+    if(k == 0)
+        return;
+    enter(a);
+    arena_free_batch(ptrs, k);
+    // mm_check();
+    leave(a);
+}
+
+// mm_realloc, without the bookkeeping of the profile. 'old' gets the
+// usable size ptr had for the caller, without the headroom of a grown
+// block, which the arena lock guards.
+static void *home_realloc(void *ptr, size_t size, size_t *old)
+{
+    arena_t *a;
+    void *newptr;
+    size_t copySize;
+    
+    *old = 0;
+    if(size<=0){
+        home_free(ptr);
+        return NULL;
+    }
+    if(ptr==NULL){
+        return home_malloc(size, 0);
+    }
+    if(IS_MAPPED(ptr) && size >= MMAP_THRESHOLD){
+        *old = usable_size(ptr);
+        return mapped_realloc(ptr, size);
+    }
+    if((a = home_arena()) == NULL)
+        return NULL;
+
+    if(!IS_MAPPED(ptr) && size < MMAP_THRESHOLD && &arenas[page_arena[PAGE_IDX(ptr)]] == a){
+        enter(a);
+        newptr = arena_realloc(ptr, size, old);
+        // mm_check();
+        leave(a);
+        return newptr;
+    }
+    *old = mm_usable_size(ptr);
+    if((newptr = home_malloc(size, 0))==NULL)
+        return NULL;
+    copySize = usable_size(ptr);
+    memcpy(newptr, ptr, copySize < size ? copySize : size);
+    home_free(ptr);
+    return newptr;
+}
+
+/*
+ * mm_realloc - Use mm_malloc only when constant approach fails.
+ *      i.e. when next free block is not big enough,
+ *      or when next block is a plain allocated block.
+ *      A block that has been grown before is moved to a block with headroom.
+ *      A block of another arena is always moved into the thread's arena.
+ *      A mapped block stays mapped while it is big enough, and is resized
+ *      by remapping. A block that grows past the threshold is moved to a
+ *      mapped block.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+    void *newptr;
+    size_t old;
+    int sampled = 0;
+
+    if(ptr != NULL && size == 0)
+        prof_free(ptr);
+    else if(ptr != NULL)
+        sampled = prof_maybe(ptr);
+    if((newptr = home_realloc(ptr, size, &old)) == NULL)
+        return NULL;
+    // only the bytes the block grew by count as allocated, so a block
+    // grown to n bytes is sampled as one malloc of n bytes would be. a
+    // sampled block keeps its sample and call path.
+    if(!sampled || !prof_move(ptr, newptr, size))
+        prof_alloc(newptr, size > old ? size - old : 0, CALLER);
+    return newptr;
+}
+
+/*
+ * mm_region_create - Makes an empty region, or returns NULL if the heap
+ *     has no room for its first chunk. A region is used by one thread
+ *     at a time.
+ */
+mm_region_t *mm_region_create(void)
+{
+    chunk_t *first;
+    mm_region_t *r;
+
+    if((first = mm_malloc(REGION_CHUNK)) == NULL)
+        return NULL;
+    first->next = NULL;
+    r = (mm_region_t *)(first+1);
+    r->chunks = first;
+    r->next_size = 2*REGION_CHUNK;
+    mm_region_reset(r);
+    return r;
+}
+
+// mm_region_alloc when the current chunk has no room for size bytes.
+// a big request gets a chunk of its own, and the current chunk stays;
+// otherwise the next chunk takes its place.
+static void *region_grow(mm_region_t *r, size_t size){
+    chunk_t *c;
+    size_t csize;
+
+    if(size > r->next_size/4)
+        csize = sizeof(chunk_t) + size;
+    else
+        csize = r->next_size;
+    if((c = mm_malloc(csize)) == NULL)
+        return NULL;
+    c->next = r->chunks;
+    r->chunks = c;
+    if(csize == r->next_size){
+        r->cur = (char *)(c+1) + size;
+        r->end = (char *)c + csize;
+        if(r->next_size < REGION_CHUNK_MAX)
+            r->next_size *= 2;
+    }
+    return c+1;
+}
+
+/*
+ * mm_region_alloc - Allocates 'size' bytes from region r, or returns NULL
+ *     if the heap has no room for another chunk. The block cannot be
+ *     freed by itself, only along with the whole region.
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size)
+{
+    char *bp;
+
+    if(size == 0 || size > MAX_HEAP)
+        return NULL;
+    size = ALIGN(size);
+    if(size > (size_t)(r->end - r->cur))
+        return region_grow(r, size);
+    bp = r->cur;
+    r->cur += size;
+    return bp;
+}
+
+/*
+ * mm_region_reset - Frees every block of region r at once, in one
+ *     mm_free per chunk. The first chunk stays for the next blocks, and
+ *     later chunks are as big as the last one was.
+ */
+void mm_region_reset(mm_region_t *r)
+{
+    chunk_t *c, *next, *first = (chunk_t *)r - 1;
+
+    for(c = r->chunks; c != first; c = next){
+        next = c->next;
+        mm_free(c);
+    }
+    r->chunks = first;
+    r->cur = (char *)(r+1);
+    r->end = (char *)first + REGION_CHUNK;
+}
+
+/*
+ * mm_region_destroy - Frees every block of region r and the region.
+ */
+void mm_region_destroy(mm_region_t *r)
+{
+    mm_region_reset(r);
+    mm_free((chunk_t *)r - 1);
+}
+
+/*
+ * mm_pool_create - Makes a pool of objects of 'size' bytes aligned to
+ *     'align', a power of two, or 0 for the alignment of mm_malloc.
+ *     Returns NULL if the objects are too big for a pool, more than an
+ *     eighth of a slab, or the heap has no room.
+ */
+mm_pool_t *mm_pool_create(size_t size, size_t align)
+{
+    mm_pool_t *p;
+
+    if(align & (align-1))
+        return NULL;
+    if(align < ALIGNMENT)
+        align = ALIGNMENT;
+    if(size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + align-1) & ~(align-1);
+    if(size > POOL_SLAB/8 || (p = mm_malloc(sizeof(mm_pool_t))) == NULL)
+        return NULL;
+    pthread_mutex_init(&p->lock, NULL);
+    p->size = size;
+    p->first = (sizeof(slab_t) + align-1) & ~(align-1);
+    p->partial = p->full = p->spare = NULL;
+    pthread_mutex_lock(&pool_lock);
+    p->id = ++pool_ids;
+    p->next = pools;
+    pools = p;
+    pthread_mutex_unlock(&pool_lock);
+    return p;
+}
+
+// the cache of the calling thread for pool p. a cache that belongs to
+// another pool is flushed first.
+static pcache_t *pool_cache(mm_pool_t *p){
+    pcache_t *c = &tcache.pool[p->id % POOL_CACHES];
+
+    if(c->id != p->id){
+        // ties the thread to an arena, so the cache is flushed when it exits
+        if(home_arena() == NULL)
+            return NULL;
+        pcache_flush(c);
+        c->id = p->id;
+    }
+    return c;
+}
+
+/*
+ * mm_pool_alloc - Allocates an object of pool p, or returns NULL if the
+ *     heap has no room for another slab. The cache of the thread is tried
+ *     first, and refilled with half its size under one lock when empty.
+ */
+void *mm_pool_alloc(mm_pool_t *p)
+{
+    pcache_t *c = &tcache.pool[p->id % POOL_CACHES];
+    void *obj, *more;
+
+    if(c->id == p->id && (obj = c->head) != NULL){
+        c->head = *(void **)obj;
+        c->count--;
+        return obj;
+    }
+    c = POOL_CACHE_COUNT > 0 ? pool_cache(p) : NULL;
+    pthread_mutex_lock(&p->lock);
+    obj = pool_get(p);
+    while(obj != NULL && c != NULL && c->count < POOL_CACHE_COUNT/2
+          && (more = pool_get(p)) != NULL){
+        *(void **)more = c->head;
+        c->head = more;
+        c->count++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return obj;
+}
+
+/*
+ * mm_pool_free - Frees obj, an object of pool p. It goes to the cache of
+ *     the thread, and half of a full cache goes back to the slabs. A slab
+ *     that empties is given back to mm, but for one kept as the spare.
+ */
+void mm_pool_free(mm_pool_t *p, void *obj)
+{
+    pcache_t *c = &tcache.pool[p->id % POOL_CACHES];
+
+    if(obj == NULL)
+        return;
+    if(c->id == p->id && c->count < POOL_CACHE_COUNT){
+        *(void **)obj = c->head;
+        c->head = obj;
+        c->count++;
+        return;
+    }
+    c = POOL_CACHE_COUNT > 0 ? pool_cache(p) : NULL;
+    pthread_mutex_lock(&p->lock);
+    pool_put(p, obj);
+    while(c != NULL && c->count > POOL_CACHE_COUNT/2){
+        obj = c->head;
+        c->head = *(void **)obj;
+        c->count--;
+        pool_put(p, obj);
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * mm_pool_destroy - Frees pool p and all its slabs, with the objects
+ *     still allocated. Objects other threads cache are dropped with it.
+ *     A null pool is ignored, like a null block of mm_free.
+ */
+void mm_pool_destroy(mm_pool_t *p)
+{
+    mm_pool_t **pp;
+    slab_t *s;
+    pcache_t *c;
+
+    if(p == NULL)
+        return;
+    c = &tcache.pool[p->id % POOL_CACHES];
+    pthread_mutex_lock(&pool_lock);
+    for(pp = &pools; *pp != p; pp = &(*pp)->next)
+        ;
+    *pp = p->next;
+    pthread_mutex_unlock(&pool_lock);
+    if(c->id == p->id){
+        c->id = 0;
+        c->head = NULL;
+        c->count = 0;
+    }
+    while((s = p->partial) != NULL){
+        p->partial = s->next;
+        mm_free(s);
+    }
+    while((s = p->full) != NULL){
+        p->full = s->next;
+        mm_free(s);
+    }
+    mm_free(p->spare);
+    pthread_mutex_destroy(&p->lock);
+    mm_free(p);
+}
+
+/*
+ * mm_trim - Gives free memory back to the OS. The free block at the top
+ *     of the heap is cut down to 'pad' bytes, and the pages inside big
+ *     free blocks are released. Returns 1 if any memory was released.
+ */
+int mm_trim(size_t pad)
+{
+    arena_t *a;
+    size_t released = 0;
+
+    if((a = home_arena()) == NULL)
+        return 0;
+    // cached blocks count as allocated, so they would keep pages
+    tcache_flush(NULL);
+    for(int i=0;i<NARENAS;i++){
+        a = &arenas[i];
+        enter(a);
+        if(a->listp != NULL){
+            remote_drain();
+            while(cur->nroom > 0)
+                headroom_reclaim(&cur->room[0]);
+            released += arena_trim(pad);
+            released += tree_release(TOPTR(GET(TREE_ROOT_PTR(free_listp))));
+            // a big top block the heap could not shrink by is released like
+            // the tree, but it keeps its zero offset too
+            if(cur->top != NULL && GET_SIZE(HDRP(cur->top)) >= TREE_MIN)
+                released += mem_release(cur->top + 2*DSIZE, GET_SIZE(HDRP(cur->top)) - 3*DSIZE);
+            // mm_check();
+        }
+        leave(a);
+    }
+    return released > 0;
+}
+
+// size of the largest free block of the current arena. it is the top block,
+// or the rightmost node of the tree, or else it is in the biggest
+// non-empty class.
+static size_t largest_free(void){
+    char *bp = TOPTR(GET(TREE_ROOT_PTR(free_listp)));
+    size_t max = cur->top != NULL ? GET_SIZE(HDRP(cur->top)) : 0;
+    unsigned int map;
+    int fl;
+
+    if(bp != NULL){
+        while(GET(TREE_RIGHT(bp)))
+            bp = TOPTR(GET(TREE_RIGHT(bp)));
+        return MAX(max, GET_SIZE(HDRP(bp)));
+    }
+    if((map = GET(FL_BITMAP(free_listp))) == 0)
+        return max;
+    fl = msb(map);
+    bp = HEAD(free_listp, fl, msb(GET(SL_BITMAP(free_listp, fl))));
+    for(; bp != NULL; bp = NEXT_FREE(bp))
+        max = MAX(max, GET_SIZE(HDRP(bp)));
+    return max;
+}
+
+/*
+ * mm_stats - Fills in the statistics of the heap. The free blocks are
+ *     counted as they come and go, so it only sums the counters of every
+ *     arena, taking one lock at a time. Blocks in thread caches and
+ *     remote queues count as used.
+ */
+void mm_stats(mm_stats_t *st)
+{
+    arena_t *a;
+    size_t lf;
+
+    memset(st, 0, sizeof(*st));
+    for(int i=0;i<NARENAS;i++){
+        a = &arenas[i];
+        enter(a);
+        if(a->listp != NULL){
+            for(int k=0;k<MM_CLASSES;k++){
+                st->class_blocks[k] += a->count.nfree[k];
+                st->class_bytes[k] += a->count.freebytes[k];
+                st->free_blocks += a->count.nfree[k];
+                st->free_bytes += a->count.freebytes[k];
+            }
+            st->splits += a->count.splits;
+            st->coalesces += a->count.coalesces;
+            st->extends += a->count.extends;
+            lf = largest_free();
+            st->largest_free = MAX(st->largest_free, lf);
+        }
+        leave(a);
+    }
+    pthread_mutex_lock(&sbrk_lock);
+    st->heap_bytes = mem_heapsize();
+    st->mapped_bytes = mapped_bytes;
+    pthread_mutex_unlock(&sbrk_lock);
+    st->used_bytes = st->heap_bytes - st->free_bytes;
+}
+
+/*
+ * mm_heap_next - Steps blk to the next block of the brk heap, in address
+ *     order, and returns 0 past the last one. A walk starts with a null
+ *     blk->bp. Prologues, fences and epilogues are left out, and a run of
+ *     slots is one allocated block. It takes no lock, so the heap must
+ *     not change during a walk.
+ */
+int mm_heap_next(mm_block_t *blk)
+{
+    char *bp = blk->bp;
+
+    // a walk starts at the prologue of the first segment
+    if(bp == NULL)
+        bp = heap_lo + DSIZE;
+    bp = NEXT_BLKP(bp);
+    // an epilogue ends a segment. the next one starts on the next page
+    // with a padding word and a fence.
+    while(GET_SIZE(HDRP(bp)) == 0){
+        bp += -(size_t)bp & (RUN_SIZE-1);
+        if(bp > (char *)mem_heap_hi())
+            return 0;
+        bp = NEXT_BLKP(bp + DSIZE);
+    }
+    blk->bp = bp;
+    blk->size = GET_SIZE(HDRP(bp));
+    blk->alloc = GET_ALLOC(HDRP(bp));
+    blk->arena = page_arena[PAGE_IDX(bp)];
+    return 1;
+}
+
+/*
+ * mm_prof_rate - Samples one in every 'rate' bytes allocated from now on,
+ *     on average, or none if it is 0. Each thread draws its next sample
+ *     with the new rate.
+ */
+void mm_prof_rate(size_t rate)
+{
+    __atomic_store_n(&prof_rate, rate, __ATOMIC_RELAXED);
+    tcache.sample = prof_interval();
+}
+
+/*
+ * mm_prof_dump - Prints the heap profile to fp: the sampled blocks that
+ *     are still allocated, summed by size class and by call path. A block
+ *     of 'size' bytes was sampled with probability 1-exp(-size/rate), so
+ *     it stands for size divided by that. The call paths are collected
+ *     under the lock of the table, and printed after it is released,
+ *     since printing may allocate.
+ */
+void mm_prof_dump(FILE *fp)
+{
+    double class_bytes[MM_CLASSES] = {0}, total = 0, bytes;
+    long class_count[MM_CLASSES] = {0};
+    size_t rate = __atomic_load_n(&prof_rate, __ATOMIC_RELAXED);
+    sample_t *sp;
+    site_t site;
+    int nsites = 0, count, i, j;
+    unsigned long dropped;
+
+    pthread_mutex_lock(&dump_lock);
+    pthread_mutex_lock(&prof_lock);
+    for(sp = prof_table; sp < prof_table+PROF_SLOTS; sp++){
+        if(sp->bp == NULL)
+            continue;
+        bytes = rate ? sp->size / (1 - exp(-(double)sp->size / rate)) : sp->size;
+        class_bytes[msb(sp->size)] += bytes;
+        class_count[msb(sp->size)]++;
+        total += bytes;
+        for(i = 0; i < nsites; i++)
+            if(prof_sites[i].depth == sp->depth
+               && memcmp(prof_sites[i].stack, sp->stack, sp->depth*sizeof(void *)) == 0)
+                break;
+        if(i == nsites){
+            memcpy(prof_sites[i].stack, sp->stack, sizeof(sp->stack));
+            prof_sites[i].depth = sp->depth;
+            prof_sites[i].count = 0;
+            prof_sites[i].bytes = 0;
+            nsites++;
+        }
+        prof_sites[i].count++;
+        prof_sites[i].bytes += bytes;
+    }
+    count = prof_count;
+    dropped = prof_dropped;
+    pthread_mutex_unlock(&prof_lock);
+
+    // the call paths that hold the most bytes first
+    for(i = 1; i < nsites; i++){
+        site = prof_sites[i];
+        for(j = i; j > 0 && prof_sites[j-1].bytes < site.bytes; j--)
+            prof_sites[j] = prof_sites[j-1];
+        prof_sites[j] = site;
+    }
+    fprintf(fp, "heap profile: %d samples, 1 in %zu bytes, %.0f bytes live, %lu dropped\n",
+            count, rate, total, dropped);
+    fprintf(fp, "%10s%10s%14s\n", "class", "blocks", "bytes");
+    for(i = 0; i < MM_CLASSES; i++)
+        if(class_count[i])
+            fprintf(fp, "%7s%-3d%10ld%14.0f\n", "2^", i, class_count[i], class_bytes[i]);
+    fprintf(fp, "%10s%14s  %s\n", "blocks", "bytes", "call path");
+    for(i = 0; i < nsites; i++){
+        fprintf(fp, "%10ld%14.0f\n", prof_sites[i].count, prof_sites[i].bytes);
+        fflush(fp);
+        backtrace_symbols_fd(prof_sites[i].stack, prof_sites[i].depth, fileno(fp));
+    }
+    pthread_mutex_unlock(&dump_lock);
+}
+
+/*
+ * mm_fork_prepare - Takes every lock of mm, in the order they nest, so
+ *     that no other thread holds one while the process forks. It is the
+ *     prepare handler of pthread_atfork.
+ */
+void mm_fork_prepare(void)
+{
+    mm_pool_t *p;
+
+    pthread_mutex_lock(&dump_lock);
+    pthread_mutex_lock(&pool_lock);
+    for(p = pools; p != NULL; p = p->next)
+        pthread_mutex_lock(&p->lock);
+    for(int i=0;i<NARENAS;i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&sbrk_lock);
+    pthread_mutex_lock(&prof_lock);
+}
+
+/*
+ * mm_fork_release - Releases the locks mm_fork_prepare took. It is the
+ *     handler of pthread_atfork in both the parent and the child.
+ */
+void mm_fork_release(void)
+{
+    mm_pool_t *p;
+
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&sbrk_lock);
+    for(int i=NARENAS-1;i>=0;i--)
+        pthread_mutex_unlock(&arenas[i].lock);
+    for(p = pools; p != NULL; p = p->next)
+        pthread_mutex_unlock(&p->lock);
+    pthread_mutex_unlock(&pool_lock);
+    pthread_mutex_unlock(&dump_lock);
+}
@@ -4,6 +4,72 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_calloc_aligned(size_t align, size_t nmemb, size_t size);
+extern size_t mm_usable_size(void *ptr);
+extern int mm_trim(size_t pad);
+extern int mm_malloc_batch(size_t size, int n, void **out);
+extern void mm_free_batch(void **ptrs, int n);
+
+/* Number of size classes of mm_stats: class i holds the free blocks
+   of 2^i to 2^(i+1)-1 bytes */
+#define MM_CLASSES 32
+
+/* Statistics of the whole heap, filled in by mm_stats */
+typedef struct {
+    size_t heap_bytes;        /* size of the brk heap */
+    size_t mapped_bytes;      /* size of the regions of mapped blocks */
+    size_t used_bytes;        /* heap bytes not in free blocks */
+    size_t free_bytes;        /* bytes in free blocks */
+    size_t free_blocks;       /* number of free blocks */
+    size_t largest_free;      /* size of the largest free block */
+    size_t class_blocks[MM_CLASSES]; /* free blocks per size class */
+    size_t class_bytes[MM_CLASSES];  /* and their bytes */
+    unsigned long splits;     /* free blocks split by an allocation */
+    unsigned long coalesces;  /* free blocks merged into a neighbour */
+    unsigned long extends;    /* times the heap was grown */
+} mm_stats_t;
+
+/* A block of the heap, as mm_heap_next reports it */
+typedef struct {
+    void *bp;                 /* payload address, NULL to start a walk */
+    size_t size;              /* block size, header included */
+    int alloc;                /* is the block allocated? */
+    int arena;                /* arena that owns the block */
+} mm_block_t;
+
+extern void mm_stats(mm_stats_t *st);
+extern int mm_heap_next(mm_block_t *blk);
+
+/* Heap profile: one in every 'rate' bytes allocated is sampled, on
+   average, and the samples that are still allocated are printed by
+   their size and call path */
+extern void mm_prof_rate(size_t rate);
+extern void mm_prof_dump(FILE *fp);
+
+/* Region: blocks carved in order out of chunks of mm_malloc, which are
+   freed all at once by mm_region_reset or mm_region_destroy */
+typedef struct mm_region mm_region_t;
+
+extern mm_region_t *mm_region_create(void);
+extern void *mm_region_alloc(mm_region_t *r, size_t size);
+extern void mm_region_reset(mm_region_t *r);
+extern void mm_region_destroy(mm_region_t *r);
+
+/* Object pool: objects of one size and alignment, carved out of slabs
+   of mm, which go back to mm once they are empty */
+typedef struct mm_pool mm_pool_t;
+
+extern mm_pool_t *mm_pool_create(size_t size, size_t align);
+extern void *mm_pool_alloc(mm_pool_t *p);
+extern void mm_pool_free(mm_pool_t *p, void *obj);
+extern void mm_pool_destroy(mm_pool_t *p);
+
+/* Fork: handlers for pthread_atfork, which hold every lock of mm across
+   fork, so that the child never finds one held by a thread it lacks */
+extern void mm_fork_prepare(void);
+extern void mm_fork_release(void);
 
 
 /* 
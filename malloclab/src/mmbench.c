@@ -0,0 +1,560 @@
+/*
+ * mmbench.c - Microbenchmarks for the malloc package in mm.c
+ *
+ * Unlike mdriver, which replays traces, each benchmark here drives
+ * mm.c with a synthetic pattern and reports its throughput.
+ *
+ *   pingpong: one thread allocates blocks and hands them to a second
+ *             thread through a queue of a given depth, which frees them.
+ *   calloc:   fills a fresh heap with cleared blocks of a given size,
+ *             once with mm_calloc and once with mm_malloc and memset.
+ *   batch:    allocates groups of blocks of one size and frees each group
+ *             together, once with single calls and once with the batch calls.
+ *   locality: chases pointers through blocks spread over the heap, once
+ *             for each kind of pages memlib can back the heap with, and
+ *             counts the dTLB misses where the CPU lets it.
+ *   pool:     replaces objects of one size at random among a fixed number
+ *             of live ones, once with mm_malloc and mm_free and once with
+ *             an object pool.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+/* Default number of blocks each benchmark allocates */
+#define DEFAULT_OPS 1000000
+
+/* Queue depths measured by pingpong */
+#define NDEPTHS 6
+static const int depths[NDEPTHS] = {1, 4, 16, 64, 256, 1024};
+
+/* Block sizes measured by calloc, and the bytes it allocates per run */
+#define NSIZES 5
+static const size_t sizes[NSIZES] = {256, 4096, 65536, 524288, 2097152};
+#define CALLOC_BYTES (16*(1<<20))
+
+/* Group sizes and block sizes measured by batch */
+#define NGROUPS 4
+static const int groups[NGROUPS] = {4, 16, 64, 256};
+#define NBATCH_SIZES 2
+static const size_t batch_sizes[NBATCH_SIZES] = {96, 1024};
+
+/* Kinds of pages measured by locality, and the bytes of blocks it chases
+   through, well past the reach of the TLB with small pages */
+#define NKINDS 3
+static const int kinds[NKINDS] = {MEM_SMALL_PAGES, MEM_THP, MEM_HUGETLB};
+static const char *kind_names[NKINDS] = {"small", "thp", "hugetlb"};
+#define LOCALITY_BYTES (16*(1<<20))
+
+/* Object sizes measured by pool, and the objects it keeps live */
+#define NPOOL_SIZES 4
+static const size_t pool_sizes[NPOOL_SIZES] = {16, 48, 128, 512};
+#define POOL_LIVE 1024
+
+/* Global variables */
+static long num_ops = DEFAULT_OPS;
+
+/* The queue between the two threads of pingpong */
+typedef struct {
+    void **slots;
+    int depth;
+    long head;           /* next slot the consumer takes */
+    long tail;           /* next slot the producer fills */
+} ring_t;
+
+/* Function prototypes */
+static double nsecs(void);
+static double bench_pingpong(int depth);
+static void *pingpong_consumer(void *arg);
+static double bench_calloc(size_t size, int use_calloc);
+static double bench_batch(size_t size, int n, int use_batch);
+static int bench_locality(int kind, double *ns, double *misses, size_t *huge);
+static double bench_pool(size_t size, int use_pool);
+static int tlb_counter(void);
+static size_t heap_huge_bytes(void);
+static void usage(void);
+static void unix_error(char *msg);
+static void app_error(char *msg);
+
+/*
+ * main - Parse command line args, then run each benchmark named on it
+ */
+int main(int argc, char **argv)
+{
+    char c;
+    int i, j, k;
+    double kops, mbs, ns, misses;
+    size_t huge;
+
+    while ((c = getopt(argc, argv, "n:h")) != EOF) {
+        switch (c) {
+	case 'n': /* Number of blocks per run */
+	    num_ops = atol(optarg);
+	    if (num_ops <= 0) {
+		usage();
+		exit(1);
+	    }
+	    break;
+        case 'h': /* Print this message */
+	    usage();
+	    exit(0);
+        default:
+	    usage();
+	    exit(1);
+        }
+    }
+    if (optind == argc) {
+	usage();
+	exit(1);
+    }
+
+    mem_init();
+    for (i = optind; i < argc; i++) {
+	if (strcmp(argv[i], "pingpong") == 0) {
+	    printf("Producer/consumer ping-pong, %ld blocks (Kops)\n", num_ops);
+	    printf("%6s%10s\n", "depth", "Kops");
+	    for (j = 0; j < NDEPTHS; j++) {
+		kops = bench_pingpong(depths[j]);
+		if (kops < 0)
+		    printf("%6d%10s\n", depths[j], "-");
+		else
+		    printf("%6d%10.0f\n", depths[j], kops);
+	    }
+	}
+	else if (strcmp(argv[i], "calloc") == 0) {
+	    printf("Cleared blocks on a fresh heap (MB/s)\n");
+	    printf("%8s%16s%10s\n", "size", "malloc+memset", "calloc");
+	    for (j = 0; j < NSIZES; j++) {
+		printf("%8zu", sizes[j]);
+		if ((mbs = bench_calloc(sizes[j], 0)) < 0)
+		    printf("%16s", "-");
+		else
+		    printf("%16.0f", mbs);
+		if ((mbs = bench_calloc(sizes[j], 1)) < 0)
+		    printf("%10s\n", "-");
+		else
+		    printf("%10.0f\n", mbs);
+	    }
+	}
+	else if (strcmp(argv[i], "batch") == 0) {
+	    printf("Groups of blocks allocated and freed together (Kops)\n");
+	    printf("%8s%6s%10s%10s\n", "size", "n", "single", "batch");
+	    for (j = 0; j < NBATCH_SIZES; j++) {
+		for (k = 0; k < NGROUPS; k++) {
+		    printf("%8zu%6d", batch_sizes[j], groups[k]);
+		    if ((kops = bench_batch(batch_sizes[j], groups[k], 0)) < 0)
+			printf("%10s", "-");
+		    else
+			printf("%10.0f", kops);
+		    if ((kops = bench_batch(batch_sizes[j], groups[k], 1)) < 0)
+			printf("%10s\n", "-");
+		    else
+			printf("%10.0f\n", kops);
+		}
+	    }
+	}
+	else if (strcmp(argv[i], "locality") == 0) {
+	    printf("Pointer chase through %d MB of blocks, %ld loads\n",
+		   LOCALITY_BYTES >> 20, 4*num_ops);
+	    printf("%8s%10s%10s%14s\n", "pages", "huge MB", "ns/load", "dTLB misses");
+	    for (j = 0; j < NKINDS; j++) {
+		printf("%8s", kind_names[j]);
+		if (!bench_locality(kinds[j], &ns, &misses, &huge))
+		    printf("%10s%10s%14s\n", "-", "-", "-");
+		else if (misses < 0)
+		    printf("%10zu%10.1f%14s\n", huge >> 20, ns, "-");
+		else
+		    printf("%10zu%10.1f%14.3f\n", huge >> 20, ns, misses);
+	    }
+	}
+	else if (strcmp(argv[i], "pool") == 0) {
+	    printf("Objects replaced at random among %d live ones, %ld ops (ns/op)\n",
+		   POOL_LIVE, num_ops);
+	    printf("%8s%10s%10s\n", "size", "malloc", "pool");
+	    for (j = 0; j < NPOOL_SIZES; j++) {
+		printf("%8zu", pool_sizes[j]);
+		if ((ns = bench_pool(pool_sizes[j], 0)) < 0)
+		    printf("%10s", "-");
+		else
+		    printf("%10.1f", ns);
+		if ((ns = bench_pool(pool_sizes[j], 1)) < 0)
+		    printf("%10s\n", "-");
+		else
+		    printf("%10.1f\n", ns);
+	    }
+	}
+	else {
+	    fprintf(stderr, "Unknown benchmark: %s\n", argv[i]);
+	    exit(1);
+	}
+    }
+    mem_deinit();
+    exit(0);
+}
+
+/*
+ * nsecs - Returns a monotonic timestamp in nanoseconds
+ */
+static double nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * pingpong_consumer - Frees every block the producer puts in the
+ *     queue, until it has freed num_ops of them
+ */
+static void *pingpong_consumer(void *arg)
+{
+    ring_t *r = (ring_t *)arg;
+    long n;
+    void *p;
+
+    for (n = 0; n < num_ops; n++) {
+	while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->head)
+	    sched_yield();
+	p = r->slots[r->head % r->depth];
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	mm_free(p);
+    }
+    return NULL;
+}
+
+/*
+ * bench_pingpong - Allocates num_ops blocks of 8 to 256 bytes on this
+ *     thread while another thread frees them, with at most depth blocks
+ *     in flight. Returns blocks per millisecond, or -1 if the heap ran out.
+ */
+static double bench_pingpong(int depth)
+{
+    ring_t r;
+    pthread_t tid;
+    double start, elapsed;
+    long n;
+    void *p;
+    int failed = 0;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in bench_pingpong");
+    if ((r.slots = malloc(depth * sizeof(void *))) == NULL)
+	unix_error("malloc failed in bench_pingpong");
+    r.depth = depth;
+    r.head = r.tail = 0;
+    srand(depth);
+
+    start = nsecs();
+    if (pthread_create(&tid, NULL, pingpong_consumer, &r) != 0)
+	unix_error("pthread_create failed in bench_pingpong");
+    for (n = 0; n < num_ops; n++) {
+	if (!failed && (p = mm_malloc(8 + rand() % 249)) == NULL)
+	    failed = 1;
+	/* after a failure the consumer still needs num_ops pointers */
+	if (failed)
+	    p = NULL;
+	while (r.tail - __atomic_load_n(&r.head, __ATOMIC_ACQUIRE) == depth)
+	    sched_yield();
+	r.slots[r.tail % depth] = p;
+	__atomic_store_n(&r.tail, r.tail + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(tid, NULL);
+    elapsed = nsecs() - start;
+    free(r.slots);
+    return failed ? -1 : num_ops / (elapsed / 1e6);
+}
+
+/*
+ * bench_calloc - Allocates cleared blocks of 'size' bytes, CALLOC_BYTES
+ *     of them or num_ops blocks, whichever is less, on a heap whose pages
+ *     were given back to the OS. Returns MB per second, or -1 if the heap
+ *     ran out.
+ */
+static double bench_calloc(size_t size, int use_calloc)
+{
+    double start, elapsed;
+    long n, nblocks;
+    void *p;
+
+    mem_reset_brk();
+    mem_release(mem_heap_lo(), MAX_HEAP);
+    if (mm_init() < 0)
+	app_error("mm_init failed in bench_calloc");
+    nblocks = CALLOC_BYTES / size;
+    if (nblocks > num_ops)
+	nblocks = num_ops;
+
+    start = nsecs();
+    for (n = 0; n < nblocks; n++) {
+	if (use_calloc)
+	    p = mm_calloc(1, size);
+	else if ((p = mm_malloc(size)) != NULL)
+	    memset(p, 0, size);
+	if (p == NULL)
+	    return -1;
+    }
+    elapsed = nsecs() - start;
+    return nblocks * size / (elapsed / 1e3);
+}
+
+/*
+ * bench_batch - Allocates num_ops blocks of 'size' bytes in groups of n,
+ *     and frees each group before the next one, with mm_malloc and mm_free
+ *     or with the batch calls. Returns blocks per millisecond, or -1 if
+ *     the heap ran out.
+ */
+static double bench_batch(size_t size, int n, int use_batch)
+{
+    double start, elapsed;
+    void **group;
+    long done;
+    int i, k = n;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in bench_batch");
+    if ((group = malloc(n * sizeof(void *))) == NULL)
+	unix_error("malloc failed in bench_batch");
+
+    /* a group the heap had no room for is freed as far as it got */
+    start = nsecs();
+    for (done = 0; done < num_ops && k == n; done += n) {
+	if (use_batch) {
+	    k = mm_malloc_batch(size, n, group);
+	    mm_free_batch(group, k);
+	}
+	else {
+	    for (k = 0; k < n && (group[k] = mm_malloc(size)) != NULL; k++)
+		;
+	    for (i = 0; i < k; i++)
+		mm_free(group[i]);
+	}
+    }
+    elapsed = nsecs() - start;
+    free(group);
+    if (k < n)
+	return -1;
+    return done / (elapsed / 1e6);
+}
+
+/*
+ * bench_locality - Allocates blocks of 16 to 256 bytes, LOCALITY_BYTES of
+ *     them or num_ops blocks, whichever is less, on a heap of the given
+ *     kind of pages. Then it links them in a random cycle and follows it
+ *     for 4*num_ops loads. Sets the time and the dTLB misses per load,
+ *     the latter -1 when the CPU does not count them, and the bytes of
+ *     the heap in huge pages. Returns 0 if memlib cannot give the kind
+ *     of pages, or the heap ran out.
+ */
+static int bench_locality(int kind, double *ns, double *misses, size_t *huge)
+{
+    void **blocks;
+    long n, nblocks, i;
+    long long count;
+    size_t size, bytes = 0;
+    double start;
+    void **p;
+    int fd, ok = 1;
+
+    mem_reset_brk();
+    if (mem_hugepages(kind) != kind) {
+	mem_hugepages(MEM_SMALL_PAGES);
+	return 0;
+    }
+    if (mm_init() < 0)
+	app_error("mm_init failed in bench_locality");
+    if ((blocks = malloc(num_ops * sizeof(void *))) == NULL)
+	unix_error("malloc failed in bench_locality");
+    srand(kind);
+    for (nblocks = 0; nblocks < num_ops && bytes < LOCALITY_BYTES; nblocks++) {
+	size = 16 + rand() % 241;
+	bytes += size;
+	if ((blocks[nblocks] = mm_malloc(size)) == NULL) {
+	    ok = 0;
+	    break;
+	}
+    }
+    if (ok) {
+	/* a random cycle through all blocks, so every load depends on the last */
+	for (i = nblocks-1; i > 0; i--) {
+	    n = rand() % (i+1);
+	    p = blocks[i];
+	    blocks[i] = blocks[n];
+	    blocks[n] = p;
+	}
+	for (i = 0; i < nblocks; i++)
+	    *(void **)blocks[i] = blocks[(i+1) % nblocks];
+	*huge = heap_huge_bytes();
+
+	fd = tlb_counter();
+	p = blocks[0];
+	start = nsecs();
+	for (n = 0; n < 4*num_ops; n++)
+	    p = *p;
+	*ns = (nsecs() - start) / (4*num_ops);
+	/* keeps the chase from being optimized away */
+	if (p == NULL)
+	    app_error("broken cycle in bench_locality");
+	*misses = -1;
+	if (fd >= 0) {
+	    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	    if (read(fd, &count, sizeof(count)) == sizeof(count))
+		*misses = (double)count / (4*num_ops);
+	    close(fd);
+	}
+    }
+    free(blocks);
+    mem_reset_brk();
+    mem_hugepages(MEM_SMALL_PAGES);
+    return ok;
+}
+
+/*
+ * bench_pool - Allocates POOL_LIVE objects of 'size' bytes, then frees
+ *     one of them at random and allocates another in its place, num_ops
+ *     times, with mm_malloc and mm_free or with an object pool. Returns
+ *     nanoseconds per call, or -1 if the heap ran out.
+ */
+static double bench_pool(size_t size, int use_pool)
+{
+    void *live[POOL_LIVE] = {NULL};
+    mm_pool_t *pool = NULL;
+    unsigned int x = 2463534242u;
+    double start, elapsed;
+    long n;
+    int i, ok = 1;
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+	app_error("mm_init failed in bench_pool");
+    if (use_pool && (pool = mm_pool_create(size, 0)) == NULL)
+	return -1;
+    for (i = 0; i < POOL_LIVE && ok; i++)
+	ok = (live[i] = use_pool ? mm_pool_alloc(pool) : mm_malloc(size)) != NULL;
+
+    start = nsecs();
+    for (n = 0; n < num_ops && ok; n++) {
+	/* xorshift, cheaper than rand next to the calls it picks for */
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	i = x % POOL_LIVE;
+	if (use_pool) {
+	    mm_pool_free(pool, live[i]);
+	    live[i] = mm_pool_alloc(pool);
+	}
+	else {
+	    mm_free(live[i]);
+	    live[i] = mm_malloc(size);
+	}
+	ok = live[i] != NULL;
+    }
+    elapsed = nsecs() - start;
+    /* the pool frees its objects with it */
+    if (use_pool)
+	mm_pool_destroy(pool);
+    else
+	for (i = 0; i < POOL_LIVE; i++)
+	    mm_free(live[i]);
+    if (!ok)
+	return -1;
+    return elapsed / (2*num_ops);
+}
+
+/*
+ * tlb_counter - Starts counting the dTLB load misses of this thread in
+ *     user mode. Returns the perf event to read them from, or -1 if the
+ *     CPU or the kernel does not count them.
+ */
+static int tlb_counter(void)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+	| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    if ((fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0)) < 0)
+	return -1;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+/*
+ * heap_huge_bytes - Returns how many bytes of the heap mapping are in
+ *     huge pages, transparent or hugetlb ones, from /proc/self/smaps
+ */
+static size_t heap_huge_bytes(void)
+{
+    char line[256];
+    FILE *fp;
+    size_t lo, hi, kb, huge = 0;
+    int in_heap = 0;
+
+    if ((fp = fopen("/proc/self/smaps", "r")) == NULL)
+	return 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+	if (sscanf(line, "%zx-%zx ", &lo, &hi) == 2)
+	    in_heap = lo <= (size_t)mem_heap_lo() && (size_t)mem_heap_lo() < hi;
+	else if (in_heap && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1
+			     || sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1))
+	    huge += kb << 10;
+    }
+    fclose(fp);
+    return huge;
+}
+
+/*
+ * usage - Explains the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mmbench [-h] [-n <ops>] <benchmark>...\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Allocate <ops> blocks per run.\n");
+    fprintf(stderr, "Benchmarks\n");
+    fprintf(stderr, "\tpingpong   Allocate on one thread, free on another.\n");
+    fprintf(stderr, "\tcalloc     Allocate cleared blocks with mm_calloc or memset.\n");
+    fprintf(stderr, "\tbatch      Allocate and free groups with single or batch calls.\n");
+    fprintf(stderr, "\tlocality   Chase pointers through the heap on small and huge pages.\n");
+    fprintf(stderr, "\tpool       Replace objects of one size with mm_malloc or a pool.\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error
+ */
+static void unix_error(char *msg)
+{
+    printf("%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
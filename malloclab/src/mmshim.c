@@ -0,0 +1,171 @@
+/*
+ * mmshim.c - The malloc calls of libc on top of mm.c, built as libmm.so
+ *
+ * Preloaded, libmm.so takes the place of the malloc of libc in any
+ * dynamically linked program:
+ *
+ *     LD_PRELOAD=./libmm.so ls -l
+ *
+ * Besides malloc, free, calloc, realloc, posix_memalign and
+ * malloc_usable_size, it exports every other call glibc asks a
+ * replacement malloc for, so that no block of the malloc of libc is ever
+ * passed to mm_free. The heap is the memlib model, which reserves
+ * MAX_HEAP bytes of address space with mmap on the first call.
+ *
+ * The blocks of mm.c are aligned to 8 bytes as in the lab, but those of
+ * libc to 16 on 64-bit hosts, the alignment of max_align_t, which SSE
+ * types and long double need. Every block comes from mm_memalign, which
+ * serves small aligned blocks from the runs as quickly as mm_malloc, and
+ * maps blocks of MMAP_THRESHOLD bytes and more on their own as usual.
+ *
+ * A child forked while another thread held a lock of mm.c would wait for
+ * it forever, so the locks are held across fork with pthread_atfork.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <malloc.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+/* the alignment libc gives every block */
+#define SHIM_ALIGN _Alignof(max_align_t)
+
+static pthread_once_t shim_once = PTHREAD_ONCE_INIT;
+static int shim_failed;
+
+/*
+ * shim_init - Sets up the heap model and mm.c, once
+ */
+static void shim_init(void)
+{
+    mem_init();
+    if (mm_init() < 0 ||
+	pthread_atfork(mm_fork_prepare, mm_fork_release, mm_fork_release) != 0)
+	shim_failed = 1;
+}
+
+/*
+ * ready - Returns whether mm.c can take calls, setting it up on the
+ *     first one. Constructors of other libraries may call malloc before
+ *     those of this one run, so it is not done in a constructor.
+ */
+static int ready(void)
+{
+    pthread_once(&shim_once, shim_init);
+    return !shim_failed;
+}
+
+/*
+ * nomem - Returns p, setting errno when it is null as libc does
+ */
+static void *nomem(void *p)
+{
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+/*
+ * aligned - Allocates size bytes aligned to align, a power of two.
+ *     Unlike the calls of mm.c, libc gives a block for 0 bytes too.
+ */
+static void *aligned(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align-1))) {
+	errno = EINVAL;
+	return NULL;
+    }
+    if (!ready())
+	return nomem(NULL);
+    return nomem(mm_memalign(align < SHIM_ALIGN ? SHIM_ALIGN : align,
+			     size ? size : 1));
+}
+
+void *malloc(size_t size)
+{
+    return aligned(SHIM_ALIGN, size);
+}
+
+void free(void *ptr)
+{
+    /* a block can only exist once mm.c is set up */
+    mm_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (!ready())
+	return nomem(NULL);
+    if (nmemb == 0 || size == 0)
+	nmemb = size = 1;
+    return nomem(mm_calloc_aligned(SHIM_ALIGN, nmemb, size));
+}
+
+/*
+ * realloc - Grows or shrinks a block with mm_realloc, which keeps it in
+ *     place when it can. When it moves the block to one that is aligned
+ *     to 8 bytes only, the block moves once more; should that fail, it
+ *     is left where it is rather than lost.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    void *p, *q;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if ((p = mm_realloc(ptr, size)) == NULL || ((size_t)p & (SHIM_ALIGN-1)) == 0)
+	return nomem(p);
+    if ((q = aligned(SHIM_ALIGN, size)) == NULL)
+	return p;
+    memcpy(q, p, size);
+    mm_free(p);
+    return q;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align % sizeof(void *) != 0)
+	return EINVAL;
+    if ((p = aligned(align, size)) == NULL)
+	return errno;
+    *memptr = p;
+    return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return aligned(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned(mem_pagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return aligned(page, (size + page-1) & ~(page-1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return mm_usable_size(ptr);
+}